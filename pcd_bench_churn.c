@@ -0,0 +1,127 @@
+/*
+	pcd_bench_churn : probe rate of the pcd platform driver under hotplug churn.
+
+	One platform device is unbound from and bound to pseudo-char-device
+	through sysfs in a loop. The probes, pool_hits, pool_misses and alloc_ns
+	driver attributes are read before and after, and the deltas give the
+	probe rate and the time spent in the allocator per probe. Needs root and
+	the pcd_device_setup and pcd_platform_driver modules loaded.
+
+	usage : pcd_bench_churn [-d device] [-n iterations]
+*/
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<getopt.h>
+#include<time.h>
+
+#define PCD_DRV_DIR	"/sys/bus/platform/drivers/pseudo-char-device/"
+
+enum { STAT_PROBES, STAT_POOL_HITS, STAT_POOL_MISSES, STAT_ALLOC_NS, STAT_NR };
+
+static const char* stat_names[STAT_NR] = {
+	[STAT_PROBES] = "probes",
+	[STAT_POOL_HITS] = "pool_hits",
+	[STAT_POOL_MISSES] = "pool_misses",
+	[STAT_ALLOC_NS] = "alloc_ns",
+};
+
+static unsigned long long now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int pcd_read_stats(long long* stats) {
+
+	char path[128];
+	FILE* f;
+	int i;
+
+	for(i = 0; i < STAT_NR; i++) {
+		snprintf(path, sizeof(path), PCD_DRV_DIR "%s", stat_names[i]);
+		f = fopen(path, "r");
+		if(!f || fscanf(f, "%lld", &stats[i]) != 1) {
+			perror(path);
+			if(f)
+				fclose(f);
+			return -1;
+		}
+		fclose(f);
+	}
+	return 0;
+}
+
+/* Write the device name to the driver's bind or unbind file */
+static int pcd_drv_write(int fd, const char* dev, const char* what) {
+
+	if(write(fd, dev, strlen(dev)) < 0) {
+		fprintf(stderr, "%s %s : %s\n", what, dev, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+
+	long long before[STAT_NR], after[STAT_NR];
+	const char* dev = "pcdev-A1x.0";
+	unsigned long long start, ns;
+	unsigned iterations = 10000, i;
+	long long probes;
+	int opt, bind_fd, unbind_fd;
+
+	while((opt = getopt(argc, argv, "d:n:")) != -1) {
+		switch(opt) {
+			case 'd':
+				dev = optarg;
+				break;
+			case 'n':
+				iterations = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage : %s [-d device] [-n iterations]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(!iterations) {
+		fprintf(stderr, "iterations must be non zero\n");
+		return 1;
+	}
+
+	bind_fd = open(PCD_DRV_DIR "bind", O_WRONLY);
+	unbind_fd = open(PCD_DRV_DIR "unbind", O_WRONLY);
+	if(bind_fd < 0 || unbind_fd < 0) {
+		perror(PCD_DRV_DIR);
+		return 1;
+	}
+	if(pcd_read_stats(before))
+		return 1;
+
+	start = now_ns();
+	for(i = 0; i < iterations; i++) {
+		if(pcd_drv_write(unbind_fd, dev, "unbind") || pcd_drv_write(bind_fd, dev, "bind"))
+			break;
+	}
+	ns = now_ns() - start;
+
+	if(pcd_read_stats(after))
+		return 1;
+	close(bind_fd);
+	close(unbind_fd);
+
+	probes = after[STAT_PROBES] - before[STAT_PROBES];
+	printf("%s : %u unbind/bind cycles in %.3f s\n", dev, i, ns / 1e9);
+	printf("%-12s %12lld %12.0f probes/s\n", "probes", probes, probes / (ns / 1e9));
+	printf("%-12s %12lld\n", "pool_hits", after[STAT_POOL_HITS] - before[STAT_POOL_HITS]);
+	printf("%-12s %12lld\n", "pool_misses", after[STAT_POOL_MISSES] - before[STAT_POOL_MISSES]);
+	printf("%-12s %12lld %12.1f ns/probe\n", "alloc_ns", after[STAT_ALLOC_NS] - before[STAT_ALLOC_NS],
+	       probes ? (double)(after[STAT_ALLOC_NS] - before[STAT_ALLOC_NS]) / probes : 0.0);
+
+	return i == iterations ? 0 : 1;
+}
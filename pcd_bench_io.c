@@ -0,0 +1,237 @@
+/*
+	pcd_bench_io : latency of small requests while large transfers run.
+
+	The device is grown to the large transfer size with PCD_IOC_RESIZE.
+	A small request thread then times n byte pwrite/pread pairs at random
+	offsets, first alone and then while large threads read and write the
+	whole buffer. With chunked copies the p99 of the small requests should
+	stay close to the idle one. -c sets the copy_chunk module parameter
+	first (root only), so chunk sizes can be compared in one session.
+
+	usage : pcd_bench_io [-d device] [-s large_mib] [-l large_threads]
+			     [-t seconds] [-n small_bytes] [-c copy_chunk]
+*/
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<getopt.h>
+#include<pthread.h>
+#include<time.h>
+#include<sys/ioctl.h>
+#include "pcd_ioctl.h"
+
+#define PCD_COPY_CHUNK_PARAM	"/sys/module/pcd_n/parameters/copy_chunk"
+
+struct pcd_lat {
+
+	unsigned long long* ns;
+	size_t nr;
+	size_t max;
+
+};
+
+static const char* dev_path = "/dev/pcd-3";
+static unsigned long long large_size = 8ULL << 20;
+static unsigned large_threads = 2;
+static unsigned seconds = 5;
+static size_t small_size = 64;
+
+static volatile int stop;
+static unsigned long long large_bytes;
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* pcd_bench_large(void* arg) {
+
+	unsigned long long bytes = 0;
+	unsigned long i;
+	char* buf;
+	ssize_t ret;
+	int fd;
+
+	fd = open(dev_path, O_RDWR);
+	buf = malloc(large_size);
+	if(fd < 0 || !buf) {
+		perror("large thread");
+		exit(1);
+	}
+	memset(buf, 0xa5, large_size);
+
+	for(i = 0; !stop; i++) {
+		if(i & 1)
+			ret = pread(fd, buf, large_size, 0);
+		else
+			ret = pwrite(fd, buf, large_size, 0);
+		if(ret < 0) {
+			perror("large transfer");
+			exit(1);
+		}
+		bytes += ret;
+	}
+
+	pthread_mutex_lock(&large_lock);
+	large_bytes += bytes;
+	pthread_mutex_unlock(&large_lock);
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+/* Time small pwrite/pread pairs for the given duration */
+static void pcd_bench_small(int fd, struct pcd_lat* lat) {
+
+	unsigned long long start, end, t0, t1;
+	char buf[4096] = { 0 };
+	off_t off;
+
+	lat->nr = 0;
+	start = now_ns();
+	end = start + seconds * 1000000000ULL;
+	do {
+		off = random() % (large_size - small_size + 1);
+		t0 = now_ns();
+		if(pwrite(fd, buf, small_size, off) < 0 || pread(fd, buf, small_size, off) < 0) {
+			perror("small request");
+			exit(1);
+		}
+		t1 = now_ns();
+
+		if(lat->nr == lat->max) {
+			lat->max = lat->max ? lat->max * 2 : 1 << 16;
+			lat->ns = realloc(lat->ns, lat->max * sizeof(*lat->ns));
+			if(!lat->ns) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		lat->ns[lat->nr++] = t1 - t0;
+	} while(t1 < end);
+}
+
+static int pcd_cmp_u64(const void* a, const void* b) {
+
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long pcd_pct(const struct pcd_lat* lat, double pct) {
+
+	return lat->ns[(size_t)(pct / 100.0 * (lat->nr - 1))];
+}
+
+static void pcd_report(const char* name, struct pcd_lat* lat) {
+
+	qsort(lat->ns, lat->nr, sizeof(*lat->ns), pcd_cmp_u64);
+	printf("%-8s %10zu %10llu %10llu %10llu %12llu\n", name, lat->nr,
+	       pcd_pct(lat, 50), pcd_pct(lat, 99), pcd_pct(lat, 99.9), lat->ns[lat->nr - 1]);
+}
+
+static int pcd_set_copy_chunk(const char* val) {
+
+	FILE* f = fopen(PCD_COPY_CHUNK_PARAM, "w");
+
+	if(!f || fputs(val, f) < 0 || fclose(f)) {
+		perror(PCD_COPY_CHUNK_PARAM);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+
+	struct pcd_lat idle = { 0 }, loaded = { 0 };
+	const char* chunk = NULL;
+	pthread_t* threads;
+	__u64 size;
+	off_t old_size;
+	unsigned i;
+	int opt, fd;
+
+	while((opt = getopt(argc, argv, "d:s:l:t:n:c:")) != -1) {
+		switch(opt) {
+			case 'd':
+				dev_path = optarg;
+				break;
+			case 's':
+				large_size = strtoull(optarg, NULL, 0) << 20;
+				break;
+			case 'l':
+				large_threads = strtoul(optarg, NULL, 0);
+				break;
+			case 't':
+				seconds = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				small_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				chunk = optarg;
+				break;
+			default:
+				fprintf(stderr, "usage : %s [-d device] [-s large_mib] [-l large_threads]"
+					" [-t seconds] [-n small_bytes] [-c copy_chunk]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(!large_size || !seconds || !small_size || small_size > 4096 || small_size > large_size) {
+		fprintf(stderr, "invalid sizes or duration\n");
+		return 1;
+	}
+	if(chunk && pcd_set_copy_chunk(chunk))
+		return 1;
+
+	fd = open(dev_path, O_RDWR);
+	if(fd < 0) {
+		perror(dev_path);
+		return 1;
+	}
+	old_size = lseek(fd, 0, SEEK_END);
+	size = large_size;
+	if(ioctl(fd, PCD_IOC_RESIZE, &size)) {
+		perror("PCD_IOC_RESIZE");
+		return 1;
+	}
+
+	printf("%s : %llu MiB transfers by %u threads, %zu byte requests, %u s per phase\n",
+	       dev_path, large_size >> 20, large_threads, small_size, seconds);
+
+	pcd_bench_small(fd, &idle);
+
+	threads = calloc(large_threads, sizeof(*threads));
+	for(i = 0; i < large_threads; i++)
+		pthread_create(&threads[i], NULL, pcd_bench_large, NULL);
+	pcd_bench_small(fd, &loaded);
+	stop = 1;
+	for(i = 0; i < large_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("\nsmall request latency (write + read), ns\n");
+	printf("%-8s %10s %10s %10s %10s %12s\n", "phase", "requests", "p50", "p99", "p99.9", "max");
+	pcd_report("idle", &idle);
+	pcd_report("loaded", &loaded);
+	printf("\nlarge transfers : %.1f MiB/s\n", (double)large_bytes / (1 << 20) / seconds);
+
+	/* give the device its size back */
+	if(old_size > 0) {
+		size = old_size;
+		if(ioctl(fd, PCD_IOC_RESIZE, &size))
+			perror("PCD_IOC_RESIZE");
+	}
+	close(fd);
+	free(threads);
+	free(idle.ns);
+	free(loaded.ns);
+	return 0;
+}
@@ -0,0 +1,165 @@
+/*
+	pcd_bench_ops : per-operation cost of the pcd devices under concurrent
+	load on all minors.
+
+	One thread per device issues small reads and writes, in the access mode
+	the device allows, for a fixed time. Then each device is opened and
+	closed in a loop. Run it against two builds of pcd_n.ko (for instance
+	before and after the file operations specialization) on the same machine
+	and compare the ns/op columns.
+
+	usage : pcd_bench_ops [-t seconds] [-n bytes] [-o opens]
+*/
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<getopt.h>
+#include<pthread.h>
+#include<time.h>
+
+#define PCD_DEVICES	4
+
+struct pcd_bench_dev {
+
+	const char* path;
+	int flags;
+	pthread_t thread;
+	unsigned long long ops;
+	unsigned long long ns;
+	int err;
+
+};
+
+static struct pcd_bench_dev devs[PCD_DEVICES] = {
+	{ .path = "/dev/pcd-0", .flags = O_RDONLY },
+	{ .path = "/dev/pcd-1", .flags = O_RDWR },
+	{ .path = "/dev/pcd-2", .flags = O_WRONLY },
+	{ .path = "/dev/pcd-3", .flags = O_RDWR },
+};
+
+static pthread_barrier_t start_barrier;
+static unsigned seconds = 5;
+static size_t io_size = 64;
+
+static unsigned long long now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* pcd_bench_io(void* arg) {
+
+	struct pcd_bench_dev* dev = arg;
+	unsigned long long start, end, ops = 0;
+	char* buf;
+	ssize_t ret;
+	int fd;
+
+	buf = calloc(1, io_size);
+	fd = open(dev->path, dev->flags);
+	if(fd < 0 || !buf) {
+		dev->err = errno;
+		pthread_barrier_wait(&start_barrier);
+		free(buf);
+		return NULL;
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	end = start + seconds * 1000000000ULL;
+	do {
+		/* batch the clock reads so they do not dominate small operations */
+		for(int i = 0; i < 256; i++, ops++) {
+			if(dev->flags == O_RDONLY || (dev->flags == O_RDWR && (ops & 1)))
+				ret = pread(fd, buf, io_size, 0);
+			else
+				ret = pwrite(fd, buf, io_size, 0);
+			if(ret < 0) {
+				dev->err = errno;
+				goto out;
+			}
+		}
+	} while(now_ns() < end);
+
+out:
+	dev->ns = now_ns() - start;
+	dev->ops = ops;
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static void pcd_bench_open(struct pcd_bench_dev* dev, unsigned opens) {
+
+	unsigned long long start;
+	unsigned i;
+	int fd;
+
+	start = now_ns();
+	for(i = 0; i < opens; i++) {
+		fd = open(dev->path, dev->flags);
+		if(fd < 0) {
+			printf("%-12s open failed : %s\n", dev->path, strerror(errno));
+			return;
+		}
+		close(fd);
+	}
+	printf("%-12s %10.1f ns/open+close\n", dev->path, (double)(now_ns() - start) / opens);
+}
+
+int main(int argc, char* argv[]) {
+
+	unsigned long long total_ops = 0;
+	unsigned opens = 100000;
+	int opt, i;
+
+	while((opt = getopt(argc, argv, "t:n:o:")) != -1) {
+		switch(opt) {
+			case 't':
+				seconds = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				io_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'o':
+				opens = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage : %s [-t seconds] [-n bytes] [-o opens]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(!seconds || !io_size || !opens) {
+		fprintf(stderr, "seconds, bytes and opens must be non zero\n");
+		return 1;
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, PCD_DEVICES);
+	for(i = 0; i < PCD_DEVICES; i++)
+		pthread_create(&devs[i].thread, NULL, pcd_bench_io, &devs[i]);
+	for(i = 0; i < PCD_DEVICES; i++)
+		pthread_join(devs[i].thread, NULL);
+
+	printf("%zu byte operations, %u s, all devices concurrently\n", io_size, seconds);
+	for(i = 0; i < PCD_DEVICES; i++) {
+		if(devs[i].err) {
+			printf("%-12s failed : %s\n", devs[i].path, strerror(devs[i].err));
+			continue;
+		}
+		printf("%-12s %12llu ops %10.1f ns/op\n", devs[i].path, devs[i].ops,
+		       (double)devs[i].ns / devs[i].ops);
+		total_ops += devs[i].ops;
+	}
+	printf("%-12s %12llu ops %10.0f ops/s\n", "total", total_ops, (double)total_ops / seconds);
+
+	printf("\nopen and close, %u times per device\n", opens);
+	for(i = 0; i < PCD_DEVICES; i++)
+		pcd_bench_open(&devs[i], opens);
+
+	return 0;
+}
@@ -0,0 +1,274 @@
+#ifndef __PCD_IOCTL_H__
+#define __PCD_IOCTL_H__
+
+#include<linux/types.h>
+#include<linux/ioctl.h>
+
+/*
+	ioctl interface of the pcd devices.
+	This header is shared by the driver and by user space programs.
+*/
+
+#define PCD_IOC_MAGIC	'p'
+
+/* Device modes */
+#define PCD_MODE_STREAM	0	/* flat byte buffer (default) */
+#define PCD_MODE_RECORD	1	/* each write() is one message */
+#define PCD_MODE_KV	2	/* key-value store, accessed through PCD_IOC_KV_* */
+#define PCD_MODE_LOG	3	/* append-only log of timestamped records */
+
+/* Flags for struct pcd_mmsg_batch */
+#define PCD_MSG_DONTWAIT	0x1
+
+/* One message slot for PCD_IOC_RECV_BATCH */
+struct pcd_mmsg {
+	__u64 buf;		/* user buffer receiving the message */
+	__u32 len;		/* size of buf */
+	__u32 msg_len;		/* out : length of the received message */
+};
+
+/* Dequeue up to vlen messages in one call (recvmmsg style) */
+struct pcd_mmsg_batch {
+	__u64 msgs;		/* user pointer to an array of struct pcd_mmsg */
+	__u32 vlen;		/* number of entries in msgs */
+	__u32 flags;		/* PCD_MSG_* */
+};
+
+#define PCD_MMSG_MAX	1024
+
+/*
+	Doorbell : sleep until the word at offset differs from expected.
+	Returns -EAGAIN if it already differs and -ETIMEDOUT when timeout_ns
+	expires. Waiters are woken by pcd write() and by PCD_IOC_WAKE.
+*/
+struct pcd_wait_word {
+	__u64 offset;		/* byte offset of the word, aligned to width */
+	__u64 expected;		/* sleep while the word holds this value */
+	__u64 timeout_ns;	/* relative timeout, 0 waits forever */
+	__u32 width;		/* 4 or 8 bytes */
+	__u32 pad;
+};
+
+/*
+	Busy polling of blocked record mode readers.
+	A reader that would sleep first spins for up to usecs waiting for a
+	message. With PCD_BUSY_POLL_ADAPTIVE the spin is skipped when recent
+	messages arrived further apart than the budget.
+*/
+#define PCD_BUSY_POLL_DEVICE	0x1	/* set the device default, needs write access */
+#define PCD_BUSY_POLL_ADAPTIVE	0x2
+#define PCD_BUSY_POLL_INHERIT	0x4	/* drop the per file setting */
+
+struct pcd_busy_poll {
+	__u32 usecs;		/* spin budget, 0 disables busy polling */
+	__u32 flags;		/* PCD_BUSY_POLL_* */
+};
+
+/* Device statistics (PCD_IOC_GET_STATS) */
+struct pcd_stats {
+	__u64 busy_poll_attempts;	/* blocked reads that spun */
+	__u64 busy_poll_hits;		/* a message arrived while spinning */
+	__u64 busy_poll_misses;		/* the budget ran out, the reader slept */
+	__u64 busy_poll_skipped;	/* adaptive polling chose to sleep right away */
+	__u64 busy_poll_ns;		/* total time spent spinning */
+	__u64 arrival_gap_ns;		/* average message inter-arrival time */
+	__u64 wakeups;			/* reader wakeups issued by writers */
+	__u64 wakeups_coalesced;	/* writes that did not wake readers */
+	__u64 wakeups_timer;		/* wakeups issued by the max latency timer */
+	__u64 mem_charged;		/* bytes charged to the memory budgets */
+	__u64 mem_reclaimed;		/* bytes given back by the shrinker */
+};
+
+/*
+	Reader wakeup watermarks for record mode.
+	A blocked reader is woken once lowat_records messages or lowat_bytes
+	payload bytes are queued, or once max_latency_us has passed since the
+	first message that did not reach a watermark. 0 disables a criterion.
+	Queued data beyond hiwat_bytes always wakes readers.
+*/
+#define PCD_WM_DEVICE		0x1	/* set the device default, needs write access */
+#define PCD_WM_INHERIT		0x2	/* drop the per file setting */
+
+struct pcd_watermark {
+	__u32 lowat_bytes;
+	__u32 lowat_records;
+	__u32 hiwat_bytes;
+	__u32 max_latency_us;
+	__u32 flags;		/* PCD_WM_* */
+	__u32 pad;
+};
+
+/*
+	NUMA placement of the device buffer.
+	Changing the node migrates the contents to memory of that node. With
+	PCD_NUMA_REPLICATE every online node gets a read-only copy which is
+	kept coherent on write, reads are served from the reader's node.
+	Setting it needs a file opened for writing.
+*/
+#define PCD_NUMA_REPLICATE	0x1
+
+struct pcd_numa {
+	__s32 node;		/* buffer node, -1 keeps the current one */
+	__u32 flags;		/* PCD_NUMA_* */
+};
+
+/*
+	Key-value mode.
+	Keys are up to PCD_KV_KEY_MAX bytes, values are stored in the device
+	buffer so their total size is bounded by the device size.
+*/
+#define PCD_KV_KEY_MAX		32
+#define PCD_KV_NOREPLACE	0x1	/* put fails with -EEXIST if the key exists */
+#define PCD_KV_BATCH_MAX	256
+
+struct pcd_kv_key {
+	__u32 len;
+	__u8 data[PCD_KV_KEY_MAX];
+};
+
+struct pcd_kv_op {
+	struct pcd_kv_key key;
+	__u32 val_len;		/* get : size of val, out : value length. put : value length */
+	__u64 val;		/* user buffer holding the value */
+	__s32 result;		/* multi-get : 0 or a negative errno for this key */
+	__u32 flags;		/* PCD_KV_* */
+};
+
+/* Multi-get of up to PCD_KV_BATCH_MAX keys */
+struct pcd_kv_batch {
+	__u64 ops;		/* user pointer to an array of struct pcd_kv_op */
+	__u32 nr;
+	__u32 pad;
+};
+
+/* Iterate over the keys, pos is an opaque cursor starting at 0 */
+struct pcd_kv_iter {
+	__u64 keys;		/* user pointer to an array of struct pcd_kv_key */
+	__u32 max;		/* entries in keys */
+	__u32 count;		/* out : keys returned, 0 at the end */
+	__u64 pos;		/* in/out : cursor */
+};
+
+/*
+	Export [offset, offset + len) of the device buffer as a dma-buf.
+	offset must be page aligned, len 0 exports up to the end of the buffer.
+	The fd can be mmap'd, passed to other processes or imported by other
+	drivers. DMA_BUF_IOCTL_SYNC brackets exclude concurrent write() calls.
+*/
+struct pcd_dmabuf_export {
+	__u64 offset;
+	__u64 len;
+	__u32 flags;		/* O_CLOEXEC, O_RDONLY or O_RDWR */
+	__s32 fd;		/* out : dma-buf file descriptor */
+};
+
+/*
+	Device side operations on stream mode buffers, the data never crosses
+	into user space. All ranges must lie within the buffer.
+*/
+
+/* Repeat a width bytes pattern (1, 2, 4 or 8) over a range aligned to width */
+struct pcd_fill {
+	__u64 offset;
+	__u64 len;
+	__u64 pattern;
+	__u32 width;
+	__u32 pad;
+};
+
+/* PCD_IOC_ZERO, len 0 clears up to the end of the buffer */
+struct pcd_range {
+	__u64 offset;
+	__u64 len;
+};
+
+/* Move len bytes within the device, the ranges may overlap */
+struct pcd_move {
+	__u64 src;
+	__u64 dst;
+	__u64 len;
+};
+
+/*
+	Copy len bytes from the pcd device open as src_fd (for reading) into the
+	device the ioctl is issued on (open for writing).
+*/
+struct pcd_copy {
+	__s32 src_fd;
+	__u32 pad;
+	__u64 src_offset;
+	__u64 dst_offset;
+	__u64 len;
+};
+
+/*
+	PCD_IOC_RESIZE sets the buffer size in bytes, also writable through the
+	size sysfs attribute. Stream contents are kept up to the smaller size,
+	queued records are kept and the call fails with -ENOSPC if they do not
+	fit. Readers are not blocked, devices in key-value mode or with
+	exported dma-bufs can not be resized (-EBUSY).
+*/
+
+/*
+	Log mode.
+	Each write() appends one record at the end of the log, whatever the
+	file offset. The log does not wrap, writes fail with -ENOSPC once it is
+	full. read() returns one whole record, header first, and 0 at the end
+	of the log. ts_ns is CLOCK_REALTIME, never going backwards in a log.
+*/
+struct pcd_log_hdr {
+	__u64 seq;		/* 0 for the first record of the log */
+	__u64 ts_ns;
+	__u32 len;		/* payload bytes following the header */
+	__u32 pad;
+};
+
+/* Position the file on the first record with a sequence number or timestamp >= key */
+#define PCD_LOG_SEEK_SEQ	0
+#define PCD_LOG_SEEK_TIME	1
+
+struct pcd_log_seek {
+	__u64 key;
+	__u32 by;		/* PCD_LOG_SEEK_* */
+	__u32 pad;
+	__u64 seq;		/* out : sequence number of that record, the next one at the end */
+};
+
+/*
+	Read filter.
+	PCD_IOC_SET_FILTER attaches a BPF_PROG_TYPE_SOCKET_FILTER program fd to
+	the open file, -1 detaches it. In record and log mode the program runs
+	on the payload of every record before it is read, the payload being the
+	packet data. Like a socket filter it returns the number of bytes to
+	deliver : 0 drops the record, less than the payload length truncates it
+	and anything larger passes it whole. Log headers report the truncated
+	length.
+*/
+
+#define PCD_IOC_SET_MODE	_IOW(PCD_IOC_MAGIC,1,__u32)
+#define PCD_IOC_GET_MODE	_IOR(PCD_IOC_MAGIC,2,__u32)
+#define PCD_IOC_RECV_BATCH	_IOW(PCD_IOC_MAGIC,3,struct pcd_mmsg_batch)
+#define PCD_IOC_WAIT_WORD	_IOW(PCD_IOC_MAGIC,4,struct pcd_wait_word)
+#define PCD_IOC_WAKE		_IO(PCD_IOC_MAGIC,5)
+#define PCD_IOC_SET_BUSY_POLL	_IOW(PCD_IOC_MAGIC,6,struct pcd_busy_poll)
+#define PCD_IOC_GET_BUSY_POLL	_IOR(PCD_IOC_MAGIC,7,struct pcd_busy_poll)
+#define PCD_IOC_GET_STATS	_IOR(PCD_IOC_MAGIC,8,struct pcd_stats)
+#define PCD_IOC_SET_WATERMARK	_IOW(PCD_IOC_MAGIC,9,struct pcd_watermark)
+#define PCD_IOC_GET_WATERMARK	_IOR(PCD_IOC_MAGIC,10,struct pcd_watermark)
+#define PCD_IOC_SET_NUMA	_IOW(PCD_IOC_MAGIC,11,struct pcd_numa)
+#define PCD_IOC_GET_NUMA	_IOR(PCD_IOC_MAGIC,12,struct pcd_numa)
+#define PCD_IOC_KV_GET		_IOWR(PCD_IOC_MAGIC,13,struct pcd_kv_op)
+#define PCD_IOC_KV_PUT		_IOW(PCD_IOC_MAGIC,14,struct pcd_kv_op)
+#define PCD_IOC_KV_DEL		_IOW(PCD_IOC_MAGIC,15,struct pcd_kv_key)
+#define PCD_IOC_KV_MGET		_IOW(PCD_IOC_MAGIC,16,struct pcd_kv_batch)
+#define PCD_IOC_KV_ITER		_IOWR(PCD_IOC_MAGIC,17,struct pcd_kv_iter)
+#define PCD_IOC_EXPORT_DMABUF	_IOWR(PCD_IOC_MAGIC,18,struct pcd_dmabuf_export)
+#define PCD_IOC_RESIZE		_IOW(PCD_IOC_MAGIC,19,__u64)
+#define PCD_IOC_FILL		_IOW(PCD_IOC_MAGIC,20,struct pcd_fill)
+#define PCD_IOC_ZERO		_IOW(PCD_IOC_MAGIC,21,struct pcd_range)
+#define PCD_IOC_MOVE		_IOW(PCD_IOC_MAGIC,22,struct pcd_move)
+#define PCD_IOC_COPY		_IOW(PCD_IOC_MAGIC,23,struct pcd_copy)
+#define PCD_IOC_LOG_SEEK	_IOWR(PCD_IOC_MAGIC,24,struct pcd_log_seek)
+#define PCD_IOC_SET_FILTER	_IOW(PCD_IOC_MAGIC,25,__s32)
+
+#endif
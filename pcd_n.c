@@ -3,6 +3,41 @@
 #include<linux/cdev.h>
 #include<linux/kdev_t.h>
 #include<linux/uaccess.h>
+#include<linux/mutex.h>
+#include<linux/wait.h>
+#include<linux/poll.h>
+#include<linux/ktime.h>
+#include<linux/slab.h>
+#include<linux/sched/signal.h>
+#include<linux/atomic.h>
+#include<linux/hrtimer.h>
+#include<linux/list.h>
+#include<linux/device.h>
+#include<linux/kref.h>
+#include<linux/rcupdate.h>
+#include<linux/vmalloc.h>
+#include<linux/gfp.h>
+#include<linux/mm.h>
+#include<linux/nodemask.h>
+#include<linux/topology.h>
+#include<linux/moduleparam.h>
+#include<linux/rhashtable.h>
+#include<linux/genalloc.h>
+#include<linux/refcount.h>
+#include<linux/wait_bit.h>
+#include<linux/dma-buf.h>
+#include<linux/dma-mapping.h>
+#include<linux/scatterlist.h>
+#include<linux/highmem.h>
+#include<linux/iosys-map.h>
+#include<linux/shrinker.h>
+#include<linux/string.h>
+#include<linux/sizes.h>
+#include<linux/file.h>
+#include<linux/bpf.h>
+#include<linux/filter.h>
+#include<linux/skbuff.h>
+#include "pcd_ioctl.h"
 
 #define TAG "[PCD]"
 #define PCD1_BUFF_SIZE 1024U
@@ -14,225 +49,3068 @@
 #define DEV_NAME "pcd"
 #define MOD_LOGI(format,...) pr_info(TAG format __VA_OPT__(,) __VA_ARGS__)
 #define MOD_LOGE(format,...) pr_err(TAG format __VA_OPT__(,) __VA_ARGS__)
+/* per call tracing of the file operations, off unless enabled through dynamic debug */
+#define MOD_LOGD(format,...) pr_debug(TAG format __VA_OPT__(,) __VA_ARGS__)
 #define RDWR	0x11
 #define WRONLY	0x10
 #define RDONLY	0x01
+/* values of the key-value mode are allocated in 16 byte granules */
+#define PCD_KV_ARENA_ORDER	4
+/* every record in record mode is prefixed with its length */
+#define PCD_REC_HDR_SIZE	sizeof(u32)
+/* adaptive busy polling gives up on a stream idle for this many average gaps */
+#define PCD_BUSY_POLL_IDLE_GAPS	4
+/* device side operations drop to the scheduler between chunks of this size */
+#define PCD_OP_CHUNK	SZ_64K
+/* log records are 8 byte aligned, every PCD_LOG_STRIDE-th record is indexed */
+#define PCD_LOG_HDR_SIZE	sizeof(struct pcd_log_hdr)
+#define PCD_LOG_ALIGN		8
+#define PCD_LOG_STRIDE		16
+/* wake readers for every message unless configured otherwise */
+#define PCD_WM_DEFAULT	{ .lowat_records = 1 }
 
-/* device memory */
-uint8_t pcd1_buff[PCD1_BUFF_SIZE];
-uint8_t pcd2_buff[PCD2_BUFF_SIZE];
-uint8_t pcd3_buff[PCD3_BUFF_SIZE];
-uint8_t pcd4_buff[PCD4_BUFF_SIZE];
+/* NUMA node of each device buffer, NUMA_NO_NODE allocates on the probing CPU's node */
+static int pcd_node[PCD_MAX_MINORS] = { [0 ... PCD_MAX_MINORS - 1] = NUMA_NO_NODE };
+module_param_array_named(node, pcd_node, int, NULL, 0444);
+MODULE_PARM_DESC(node, "NUMA node of each device buffer");
 
-/* Device private data */
+static bool first_use;
+module_param(first_use, bool, 0444);
+MODULE_PARM_DESC(first_use, "Allocate device buffers on the node of their first opener");
+
+/* Large stream transfers are split so that they do not hold the CPU or the device lock for long */
+static unsigned int copy_chunk = PAGE_SIZE;
+module_param(copy_chunk, uint, 0644);
+MODULE_PARM_DESC(copy_chunk, "Bytes copied by stream read() and write() between preemption points, 0 for a page");
+
+/* Memory budgets, 0 means unlimited */
+static unsigned long max_total_kb;
+module_param(max_total_kb, ulong, 0644);
+MODULE_PARM_DESC(max_total_kb, "Memory budget of all pcd buffers and replicas in KiB");
+
+static unsigned long pcd_max_kb[PCD_MAX_MINORS];
+module_param_array_named(max_kb, pcd_max_kb, ulong, NULL, 0644);
+MODULE_PARM_DESC(max_kb, "Memory budget of each device in KiB");
+
+/* bytes charged against max_total_kb */
+static atomic_long_t pcd_total_bytes;
+
+/*
+	Device memory
+	Buffers are built from pages of the chosen node and mapped contiguously,
+	which also keeps them word aligned for the doorbell ioctl.
+*/
+struct pcd_backing {
+
+	unsigned size;
+	int node;
+	unsigned nr_pages;
+	struct page** pages;
+	char* data;
+	/* read-only copies indexed by node id, NULL when not replicated */
+	char** replica;
+	/* bytes charged to the owner's budget */
+	struct pcdev_private_data* owner;
+	size_t charged;
+	/* held by the device while published and by readers while copying */
+	struct kref ref;
+	struct rcu_head rcu;
+
+};
+
+/* Key-value mode state of a device */
+struct pcd_kv {
+
+	struct rhashtable ht;
+	/* values, carved out of the device buffer */
+	struct gen_pool* arena;
+	/* entries not yet freed, the arena outlives them */
+	atomic_t nr_entries;
+
+};
+
+/*
+	Device private data
+	The devices sit next to each other in pcdrv_data, so each one starts on
+	its own cache line and the fields touched on every read or write are
+	grouped on separate lines : read-mostly state used by lockless readers,
+	state written by writers under lock, and the statistics counters.
+	Configuration and identity come first, they are only used on open and
+	on configuration changes.
+*/
 struct pcdev_private_data {
 
-	char* buffer;
-	unsigned size;
-	const char* serial_number;
-	int perm;
-	struct cdev cdev;
+	const char* serial_number;
+	int perm;
+	struct cdev cdev;
+
+	/* NUMA placement, protected by lock */
+	int node;
+	bool replicate;
+
+	/* live dma-buf exports of the buffer, which pin the backing. Protected by lock */
+	unsigned exports;
+
+	/* memory charged against the budgets, and returned by the shrinker */
+	atomic_long_t charged;
+	atomic64_t reclaimed;
+
+	/* reader wakeup watermarks, protected by lock */
+	struct pcd_watermark wm;
+	/* open files, protected by lock */
+	struct list_head files;
+	/* fires max_latency_us after the first message that did not wake readers */
+	struct hrtimer wm_timer;
+
+	/* published with RCU, see pcd_bk() for the rules */
+	struct pcd_backing __rcu* bk ____cacheline_aligned_in_smp;
+	/* configured size, changes with PCD_IOC_RESIZE under lock */
+	unsigned size;
+	/* PCD_MODE_* , changed through PCD_IOC_SET_MODE */
+	int mode;
+	/* key-value store, published with RCU while in PCD_MODE_KV */
+	struct pcd_kv __rcu* kv;
+	/* busy poll defaults for readers of this device */
+	u32 busy_poll_us;
+	bool busy_poll_adaptive;
+	/* doorbell waiters (PCD_IOC_WAIT_WORD) */
+	wait_queue_head_t db_wq;
+
+	/* serializes writers, record mode I/O and configuration changes */
+	struct mutex lock ____cacheline_aligned_in_smp;
+	wait_queue_head_t rd_wq;
+	wait_queue_head_t wr_wq;
+
+	/* record ring state, protected by lock */
+	unsigned head;
+	unsigned tail;
+	unsigned used;
+	unsigned nr_records;
+
+	/* dma-buf users inside a begin/end_cpu_access bracket, stream writers wait for them */
+	unsigned cpu_access;
+	/* loosest watermark of all readers, used by writers to decide on wakeups */
+	struct pcd_watermark wm_eff;
+	bool wm_expired;
+	/* message arrivals, written under lock and sampled locklessly */
+	u64 last_arrival_ns;
+	u64 arrival_gap_ns;
+
+	/* log mode : end of the last record, published with release semantics */
+	unsigned log_tail;
+	/* sequence number of the next record and timestamp of the last one, protected by lock */
+	u64 log_seq;
+	u64 log_last_ns;
+	/* offsets of records 0, PCD_LOG_STRIDE, 2 * PCD_LOG_STRIDE ... */
+	u32* log_index;
+
+	atomic64_t busy_poll_attempts ____cacheline_aligned_in_smp;
+	atomic64_t busy_poll_hits;
+	atomic64_t busy_poll_misses;
+	atomic64_t busy_poll_skipped;
+	atomic64_t busy_poll_ns;
+
+	atomic64_t wakeups;
+	atomic64_t wakeups_coalesced;
+	atomic64_t wakeups_timer;
+
+} ____cacheline_aligned_in_smp;
+
+/* Per open file data */
+struct pcd_file_data {
+
+	struct pcdev_private_data* pcdev_data;
+	/* busy poll override, only used when busy_poll_set */
+	bool busy_poll_set;
+	bool busy_poll_adaptive;
+	u32 busy_poll_us;
+	/* wakeup watermark override, only used when wm_set */
+	bool wm_set;
+	struct pcd_watermark wm;
+	bool reader;
+	/* offset of the next log record to read */
+	unsigned log_pos;
+	/* read filter, changed under the device lock and freed after a grace period */
+	struct bpf_prog __rcu* filter;
+	/* entry in pcdev_data->files */
+	struct list_head node;
+
+};
+
+
+/* Driver private data */
+struct pcdrv_private_data {
+
+	int total_dev;
+	dev_t dev_num;
+	struct class* class_pcd;
+	struct device* device_pcd;
+	struct pcdev_private_data pcdev_data[PCD_MAX_MINORS];
+	
+};
+
+struct pcdrv_private_data pcdrv_data = 
+{	
+	.total_dev = PCD_MAX_MINORS,
+	.pcdev_data = 
+	{
+		[0] = 
+		{
+			.size  = PCD1_BUFF_SIZE,
+			.serial_number = "PCDEV1",
+			.perm = RDONLY,
+			.wm = PCD_WM_DEFAULT
+				
+		},
+		
+		[1] = 
+		{
+			.size  = PCD2_BUFF_SIZE,
+			.serial_number = "PCDEV2",
+			.perm = RDWR,
+			.wm = PCD_WM_DEFAULT
+				
+		},
+		
+		[2] = 
+		{
+			.size  = PCD3_BUFF_SIZE,
+			.serial_number = "PCDEV3",
+			.perm = WRONLY,
+			.wm = PCD_WM_DEFAULT
+				
+		},
+		
+		[3] = 
+		{
+			.size  = PCD4_BUFF_SIZE,
+			.serial_number = "PCDEV4",  
+			.perm = RDWR,
+			.wm = PCD_WM_DEFAULT
+				
+		}
+	}
+
+};
+
+static int pcd_open(struct inode* inode, struct file* file);
+static int pcd_release(struct inode* inode, struct file* file);
+static ssize_t pcd_stream_read(struct file * file, char __user * buff, size_t size, loff_t * offset);
+static ssize_t pcd_stream_write(struct file * file, const char __user * buff, size_t size, loff_t * offset);
+static ssize_t pcd_record_read(struct file* file, char __user* buff, size_t size, loff_t* offset);
+static ssize_t pcd_record_write(struct file* file, const char __user* buff, size_t size, loff_t* offset);
+static ssize_t pcd_log_read(struct file* file, char __user* buff, size_t size, loff_t* offset);
+static ssize_t pcd_log_write(struct file* file, const char __user* buff, size_t size, loff_t* offset);
+static ssize_t pcd_kv_read(struct file* file, char __user* buff, size_t size, loff_t* offset);
+static ssize_t pcd_kv_write(struct file* file, const char __user* buff, size_t size, loff_t* offset);
+static loff_t pcd_llseek(struct file* file, loff_t off, int whence);
+static __poll_t pcd_stream_poll(struct file* file, struct poll_table_struct* wait);
+static __poll_t pcd_record_poll(struct file* file, struct poll_table_struct* wait);
+static __poll_t pcd_log_poll(struct file* file, struct poll_table_struct* wait);
+static long pcd_ioctl(struct file* file, unsigned int cmd, unsigned long arg);
+static void pcd_wm_recalc(struct pcdev_private_data* pcdev_data);
+static int pcd_backing_populate(struct pcdev_private_data* pcdev_data);
+static void pcd_doorbell_wake(struct pcdev_private_data* pcdev_data);
+
+
+/* File operations for pcd, only used to open a device */
+struct file_operations pcd_fops = {
+	.owner = THIS_MODULE,
+	.open  = pcd_open,
+	.release = pcd_release
+};
+
+/*
+	Open installs one of the tables below, picked by the device mode and the
+	access mode of the file, so read and write go straight to the path of the
+	mode. A file that can not write has no write method at all, one that can
+	not read no read method. Every table of an access mode has the same
+	methods, so the FMODE_CAN_READ/WRITE bits set at open stay right when
+	PCD_IOC_SET_MODE swaps the table.
+*/
+#define PCD_FOPS_COMMON				\
+	.owner = THIS_MODULE,			\
+	.release = pcd_release,			\
+	.unlocked_ioctl = pcd_ioctl,		\
+	.compat_ioctl = compat_ptr_ioctl
+
+#define PCD_FOPS(name, rd, wr, seek, pl)					\
+static const struct file_operations name##_rw_fops = {				\
+	PCD_FOPS_COMMON, .read = rd, .write = wr, .llseek = seek, .poll = pl	\
+};										\
+static const struct file_operations name##_ro_fops = {				\
+	PCD_FOPS_COMMON, .read = rd, .llseek = seek, .poll = pl			\
+};										\
+static const struct file_operations name##_wo_fops = {				\
+	PCD_FOPS_COMMON, .write = wr, .llseek = seek, .poll = pl		\
+}
+
+PCD_FOPS(pcd_stream, pcd_stream_read, pcd_stream_write, pcd_llseek, pcd_stream_poll);
+/* messages and keys are not addressable by offset */
+PCD_FOPS(pcd_record, pcd_record_read, pcd_record_write, no_llseek, pcd_record_poll);
+PCD_FOPS(pcd_log, pcd_log_read, pcd_log_write, no_llseek, pcd_log_poll);
+PCD_FOPS(pcd_kv, pcd_kv_read, pcd_kv_write, no_llseek, pcd_stream_poll);
+
+/* indexed by PCD_MODE_* then by access : read-only, write-only, read-write */
+static const struct file_operations* const pcd_mode_fops_table[][3] = {
+	[PCD_MODE_STREAM] = { &pcd_stream_ro_fops, &pcd_stream_wo_fops, &pcd_stream_rw_fops },
+	[PCD_MODE_RECORD] = { &pcd_record_ro_fops, &pcd_record_wo_fops, &pcd_record_rw_fops },
+	[PCD_MODE_KV] = { &pcd_kv_ro_fops, &pcd_kv_wo_fops, &pcd_kv_rw_fops },
+	[PCD_MODE_LOG] = { &pcd_log_ro_fops, &pcd_log_wo_fops, &pcd_log_rw_fops },
+};
+
+static const struct file_operations* pcd_mode_fops(struct file* file, int mode) {
+
+	if(!(file->f_mode & FMODE_WRITE))
+		return pcd_mode_fops_table[mode][0];
+	if(!(file->f_mode & FMODE_READ))
+		return pcd_mode_fops_table[mode][1];
+	return pcd_mode_fops_table[mode][2];
+}
+
+int check_permission(int dev_perm, int acc_mode){
+
+	int req = (acc_mode & FMODE_READ ? RDONLY : 0) | (acc_mode & FMODE_WRITE ? WRONLY : 0);
+
+	/* read-only and write-only devices only accept exactly that access */
+	if(dev_perm == RDWR || req == dev_perm) {
+		return 0;
+	}
+	
+	return -EPERM;
+}
+static int pcd_open(struct inode* inode, struct file* file) {
+
+	MOD_LOGD("open");
+	int ret;
+	/* get information about the minor that was opened */
+	int minor = MINOR(inode->i_rdev);
+	MOD_LOGD("minor accessed %d",minor);
+	/* 
+		container_of macro returns pointer to the structure containing member 
+		container_of(ptr,type,member)
+	*/
+	struct pcdev_private_data* pcdev_data = container_of(inode->i_cdev,struct pcdev_private_data,cdev);
+	struct pcd_file_data* fdata;
+	
+	/* check permissions */
+	ret = check_permission(pcdev_data->perm,file->f_mode);
+	if(ret) {
+		MOD_LOGE("open was unsuccessfull");
+		return ret;
+	}
+	
+	fdata = kzalloc(sizeof(*fdata),GFP_KERNEL);
+	if(!fdata)
+		return -ENOMEM;
+	fdata->pcdev_data = pcdev_data;
+	fdata->reader = file->f_mode & FMODE_READ;
+	
+	mutex_lock(&pcdev_data->lock);
+	/* buffers placed on first use are allocated on the node of the first opener */
+	ret = pcd_backing_populate(pcdev_data);
+	if(!ret) {
+		list_add(&fdata->node,&pcdev_data->files);
+		/* a reader on the device watermark loosens the writer side one again */
+		if(fdata->reader)
+			pcd_wm_recalc(pcdev_data);
+		/* under lock, the mode can not change before we are on the list */
+		replace_fops(file,fops_get(pcd_mode_fops(file,pcdev_data->mode)));
+	}
+	mutex_unlock(&pcdev_data->lock);
+	if(ret) {
+		kfree(fdata);
+		return ret;
+	}
+	
+	/* Supply per open data, which leads to the device private data, to other methods of driver */
+	file->private_data = fdata;
+	
+	MOD_LOGD("open was successfull");
+	return 0;
+}
+
+static int pcd_release(struct inode* inode, struct file* file) {
+
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+
+	MOD_LOGD("release");
+	mutex_lock(&pcdev_data->lock);
+	list_del(&fdata->node);
+	if(fdata->reader)
+		pcd_wm_recalc(pcdev_data);
+	mutex_unlock(&pcdev_data->lock);
+
+	if(rcu_access_pointer(fdata->filter))
+		bpf_prog_put(rcu_dereference_protected(fdata->filter, 1));
+	kfree(fdata);
+	return 0;
+}
+
+static inline struct pcdev_private_data* pcd_file_dev(struct file* file) {
+
+	return ((struct pcd_file_data*)file->private_data)->pcdev_data;
+}
+
+
+/*
+	Backing memory
+	bk is only replaced under lock, so it is stable for holders of the lock.
+	Stream readers never take the lock : they reference the published
+	backing with pcd_backing_get(), and a replaced backing is freed once its
+	last reader is done and an RCU grace period has passed.
+*/
+static inline struct pcd_backing* pcd_bk(struct pcdev_private_data* pcdev_data) {
+
+	return rcu_dereference_protected(pcdev_data->bk, lockdep_is_held(&pcdev_data->lock));
+}
+
+/*
+	Charge bytes to the device and driver budgets. Allocations themselves
+	use GFP_KERNEL_ACCOUNT so they are also charged to the caller's memcg.
+*/
+static int pcd_charge(struct pcdev_private_data* pcdev_data, size_t bytes) {
+
+	unsigned long dev_max = READ_ONCE(pcd_max_kb[pcdev_data - pcdrv_data.pcdev_data]);
+	unsigned long total_max = READ_ONCE(max_total_kb);
+
+	if(dev_max && atomic_long_add_return(bytes, &pcdev_data->charged) > dev_max * SZ_1K) {
+		atomic_long_sub(bytes, &pcdev_data->charged);
+		return -EDQUOT;
+	}
+	if(!dev_max)
+		atomic_long_add(bytes, &pcdev_data->charged);
+
+	if(total_max && atomic_long_add_return(bytes, &pcd_total_bytes) > total_max * SZ_1K) {
+		atomic_long_sub(bytes, &pcd_total_bytes);
+		atomic_long_sub(bytes, &pcdev_data->charged);
+		return -EDQUOT;
+	}
+	if(!total_max)
+		atomic_long_add(bytes, &pcd_total_bytes);
+
+	return 0;
+}
+
+static void pcd_uncharge(struct pcdev_private_data* pcdev_data, size_t bytes) {
+
+	atomic_long_sub(bytes, &pcdev_data->charged);
+	atomic_long_sub(bytes, &pcd_total_bytes);
+}
+
+static void pcd_backing_free(struct pcd_backing* bk) {
+
+	unsigned i;
+	int nid;
+
+	if(!bk)
+		return;
+
+	if(bk->replica) {
+		for_each_node(nid)
+			kvfree(bk->replica[nid]);
+		kfree(bk->replica);
+	}
+	if(bk->data)
+		vunmap(bk->data);
+	if(bk->pages) {
+		for(i = 0; i < bk->nr_pages && bk->pages[i]; i++)
+			__free_page(bk->pages[i]);
+		kfree(bk->pages);
+	}
+	if(bk->charged)
+		pcd_uncharge(bk->owner, bk->charged);
+	kfree(bk);
+}
+
+static void pcd_backing_free_rcu(struct rcu_head* rcu) {
+
+	pcd_backing_free(container_of(rcu, struct pcd_backing, rcu));
+}
+
+static void pcd_backing_release(struct kref* ref) {
+
+	struct pcd_backing* bk = container_of(ref, struct pcd_backing, ref);
+
+	/* lockless users may have loaded the pointer but not referenced it yet */
+	call_rcu(&bk->rcu, pcd_backing_free_rcu);
+}
+
+static inline void pcd_backing_put(struct pcd_backing* bk) {
+
+	kref_put(&bk->ref, pcd_backing_release);
+}
+
+/* Reference the published backing without blocking, NULL if there is none */
+static struct pcd_backing* pcd_backing_get(struct pcdev_private_data* pcdev_data) {
+
+	struct pcd_backing* bk;
+
+	rcu_read_lock();
+	do {
+		bk = rcu_dereference(pcdev_data->bk);
+	/* a backing losing its last reference has already been replaced, look again */
+	} while(bk && !kref_get_unless_zero(&bk->ref));
+	rcu_read_unlock();
+
+	return bk;
+}
+
+/*
+	Allocate zeroed backing memory of size bytes for pcdev_data on node nid,
+	optionally with a read-only copy on every other online node.
+*/
+static struct pcd_backing* pcd_backing_alloc(struct pcdev_private_data* pcdev_data, unsigned size, int nid, bool replicate) {
+
+	struct pcd_backing* bk;
+	size_t bytes;
+	unsigned i;
+	int rnid;
+	int ret;
+
+	bytes = (size_t)DIV_ROUND_UP(size,PAGE_SIZE) << PAGE_SHIFT;
+	if(replicate)
+		bytes += (size_t)size * (num_online_nodes() - 1);
+	ret = pcd_charge(pcdev_data,bytes);
+	if(ret)
+		return ERR_PTR(ret);
+
+	bk = kzalloc_node(sizeof(*bk),GFP_KERNEL,nid);
+	if(!bk) {
+		pcd_uncharge(pcdev_data,bytes);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	bk->owner = pcdev_data;
+	bk->charged = bytes;
+	kref_init(&bk->ref);
+	bk->size = size;
+	bk->nr_pages = DIV_ROUND_UP(size,PAGE_SIZE);
+	bk->pages = kcalloc_node(bk->nr_pages,sizeof(*bk->pages),GFP_KERNEL,nid);
+	if(!bk->pages)
+		goto fail;
+
+	for(i = 0; i < bk->nr_pages; i++) {
+		bk->pages[i] = alloc_pages_node(nid,GFP_KERNEL_ACCOUNT | __GFP_ZERO,0);
+		if(!bk->pages[i])
+			goto fail;
+	}
+
+	bk->data = vmap(bk->pages,bk->nr_pages,VM_MAP,PAGE_KERNEL);
+	if(!bk->data)
+		goto fail;
+	bk->node = page_to_nid(bk->pages[0]);
+
+	if(replicate) {
+		bk->replica = kcalloc(nr_node_ids,sizeof(*bk->replica),GFP_KERNEL);
+		if(!bk->replica)
+			goto fail;
+		/* readers on the buffer's own node use the primary copy */
+		for_each_online_node(rnid) {
+			if(rnid == bk->node)
+				continue;
+			bk->replica[rnid] = kvzalloc_node(size,GFP_KERNEL_ACCOUNT,rnid);
+			if(!bk->replica[rnid])
+				goto fail;
+		}
+	}
+
+	return bk;
+
+fail :
+	pcd_backing_free(bk);
+	return ERR_PTR(-ENOMEM);
+}
+
+/* The copy of the buffer closest to the calling CPU */
+static inline char* pcd_backing_local(struct pcd_backing* bk) {
+
+	char* data;
+
+	if(!bk->replica)
+		return bk->data;
+	data = bk->replica[numa_node_id()];
+	return data ? data : bk->data;
+}
+
+/* Propagate a write of [off, off + len) to the replicas, called with lock held */
+static void pcd_backing_sync(struct pcd_backing* bk, unsigned off, unsigned len) {
+
+	int nid;
+
+	if(!bk->replica)
+		return;
+	for_each_online_node(nid)
+		if(bk->replica[nid])
+			memcpy(bk->replica[nid] + off, bk->data + off, len);
+}
+
+/* Publish a new backing and drop the device's reference on the old one, called with lock held */
+static void pcd_backing_swap(struct pcdev_private_data* pcdev_data, struct pcd_backing* bk) {
+
+	struct pcd_backing* old;
+
+	old = rcu_replace_pointer(pcdev_data->bk,bk,lockdep_is_held(&pcdev_data->lock));
+
+	/* readers still copying from the old buffer keep it alive */
+	if(old)
+		pcd_backing_put(old);
+}
+
+/* Allocate a backing deferred to first use, on the current node. Called with lock held */
+static int pcd_backing_populate(struct pcdev_private_data* pcdev_data) {
+
+	struct pcd_backing* bk;
+	int nid = pcdev_data->node;
+
+	if(rcu_access_pointer(pcdev_data->bk))
+		return 0;
+
+	if(nid == NUMA_NO_NODE)
+		nid = numa_node_id();
+	bk = pcd_backing_alloc(pcdev_data,pcdev_data->size,nid,pcdev_data->replicate);
+	if(IS_ERR(bk))
+		return PTR_ERR(bk);
+
+	rcu_assign_pointer(pcdev_data->bk,bk);
+	MOD_LOGI("%s buffer placed on node %d",pcdev_data->serial_number,bk->node);
+	return 0;
+}
+
+/* Move the buffer to another node and/or change replication, called with lock held */
+static int pcd_backing_migrate(struct pcdev_private_data* pcdev_data, int nid, bool replicate) {
+
+	struct pcd_backing* old = pcd_bk(pcdev_data);
+	struct pcd_backing* bk;
+
+	bk = pcd_backing_alloc(pcdev_data,pcdev_data->size,nid,replicate);
+	if(IS_ERR(bk))
+		return PTR_ERR(bk);
+
+	/* writers are excluded by lock, the contents can not change under us */
+	memcpy(bk->data,old->data,pcdev_data->size);
+	pcd_backing_sync(bk,0,pcdev_data->size);
+
+	pcd_backing_swap(pcdev_data,bk);
+	return 0;
+}
+
+/* Copy len bytes of the record ring starting at pos into dst, defined with the ring helpers */
+static void pcd_ring_peek(struct pcdev_private_data* pcdev_data, unsigned pos, void* dst, unsigned len);
+
+/*
+	Grow or shrink the buffer to size bytes, called with lock held.
+	Stream contents are kept up to the smaller size, queued records are
+	moved to the start of the new ring. Readers keep going on the old
+	buffer until they are done with it.
+*/
+static int pcd_backing_resize(struct pcdev_private_data* pcdev_data, unsigned size) {
+
+	struct pcd_backing* old = pcd_bk(pcdev_data);
+	struct pcd_backing* bk;
+
+	/* the key-value arena and the log index are built over the current buffer */
+	if(pcdev_data->mode == PCD_MODE_KV || pcdev_data->mode == PCD_MODE_LOG || pcdev_data->exports)
+		return -EBUSY;
+	if(pcdev_data->mode == PCD_MODE_RECORD && (size <= PCD_REC_HDR_SIZE || size < pcdev_data->used))
+		return -ENOSPC;
+
+	/* not allocated yet, or reclaimed : the next open allocates the new size */
+	if(!old) {
+		WRITE_ONCE(pcdev_data->size,size);
+		return 0;
+	}
+
+	bk = pcd_backing_alloc(pcdev_data,size,old->node,pcdev_data->replicate);
+	if(IS_ERR(bk))
+		return PTR_ERR(bk);
+
+	/* writers are excluded by lock, the contents can not change under us */
+	if(pcdev_data->mode == PCD_MODE_RECORD) {
+		pcd_ring_peek(pcdev_data,pcdev_data->head,bk->data,pcdev_data->used);
+		pcdev_data->head = 0;
+		pcdev_data->tail = pcdev_data->used % size;
+	} else {
+		memcpy(bk->data,old->data,min(size,old->size));
+	}
+	pcd_backing_sync(bk,0,size);
+
+	WRITE_ONCE(pcdev_data->size,size);
+	pcd_backing_swap(pcdev_data,bk);
+
+	MOD_LOGI("%s resized to %u bytes",pcdev_data->serial_number,size);
+	/* writers waiting for space may now fit, or never will */
+	wake_up_interruptible(&pcdev_data->wr_wq);
+	return 0;
+}
+
+
+/*
+	Record mode
+	The device buffer is used as a ring of messages. Every message is stored
+	as a u32 length followed by the payload, both may wrap around the end of
+	the buffer. A write() queues exactly one message and a read() dequeues
+	exactly one message.
+*/
+
+/* Copy len bytes out of the ring starting at pos */
+static void pcd_ring_peek(struct pcdev_private_data* pcdev_data, unsigned pos, void* dst, unsigned len) {
+
+	unsigned first = min(len, pcdev_data->size - pos);
+
+	char* data = pcd_bk(pcdev_data)->data;
+
+	memcpy(dst, data + pos, first);
+	memcpy((char*)dst + first, data, len - first);
+}
+
+/* Copy len bytes into the ring starting at pos */
+static void pcd_ring_poke(struct pcdev_private_data* pcdev_data, unsigned pos, const void* src, unsigned len) {
+
+	unsigned first = min(len, pcdev_data->size - pos);
+
+	char* data = pcd_bk(pcdev_data)->data;
+
+	memcpy(data + pos, src, first);
+	memcpy(data, (const char*)src + first, len - first);
+}
+
+static int pcd_ring_copy_to_user(struct pcdev_private_data* pcdev_data, unsigned pos, char __user* buff, unsigned len) {
+
+	unsigned first = min(len, pcdev_data->size - pos);
+
+	char* data = pcd_bk(pcdev_data)->data;
+
+	if(copy_to_user(buff, data + pos, first))
+		return -EFAULT;
+	if(copy_to_user(buff + first, data, len - first))
+		return -EFAULT;
+	return 0;
+}
+
+static int pcd_ring_copy_from_user(struct pcdev_private_data* pcdev_data, unsigned pos, const char __user* buff, unsigned len) {
+
+	unsigned first = min(len, pcdev_data->size - pos);
+
+	char* data = pcd_bk(pcdev_data)->data;
+
+	if(copy_from_user(data + pos, buff, first))
+		return -EFAULT;
+	if(copy_from_user(data, buff + first, len - first))
+		return -EFAULT;
+	return 0;
+}
+
+/* Reset the ring, called with lock held */
+static void pcd_ring_reset(struct pcdev_private_data* pcdev_data) {
+
+	pcdev_data->head = 0;
+	pcdev_data->tail = 0;
+	pcdev_data->used = 0;
+	pcdev_data->nr_records = 0;
+}
+
+/*
+	Wakeup watermarks
+	Writers only wake readers once enough data is queued for the loosest
+	watermark of any reader, or when the max latency timer expires, so a
+	burst of small messages costs a single wakeup.
+*/
+static inline const struct pcd_watermark* pcd_file_wm(struct pcd_file_data* fdata) {
+
+	return fdata->wm_set ? &fdata->wm : &fdata->pcdev_data->wm;
+}
+
+/* Smallest non zero value, 0 disables a watermark */
+static inline u32 pcd_wm_min(u32 a, u32 b) {
+
+	if(!a)
+		return b;
+	if(!b)
+		return a;
+	return min(a, b);
+}
+
+/*
+	Recompute the writer side watermark, called with lock held. The device
+	watermark only takes part through readers that did not set their own,
+	or when there are no readers at all.
+*/
+static void pcd_wm_recalc(struct pcdev_private_data* pcdev_data) {
+
+	struct pcd_watermark eff = pcdev_data->wm;
+	const struct pcd_watermark* wm;
+	struct pcd_file_data* fdata;
+	bool first = true;
+
+	list_for_each_entry(fdata, &pcdev_data->files, node) {
+		if(!fdata->reader)
+			continue;
+		wm = pcd_file_wm(fdata);
+		if(first) {
+			eff = *wm;
+			first = false;
+			continue;
+		}
+		eff.lowat_bytes = pcd_wm_min(eff.lowat_bytes, wm->lowat_bytes);
+		eff.lowat_records = pcd_wm_min(eff.lowat_records, wm->lowat_records);
+		eff.hiwat_bytes = pcd_wm_min(eff.hiwat_bytes, wm->hiwat_bytes);
+		eff.max_latency_us = pcd_wm_min(eff.max_latency_us, wm->max_latency_us);
+	}
+	pcdev_data->wm_eff = eff;
+}
+
+/* Whether queued messages satisfy the watermark wm, may be called without lock */
+static bool pcd_record_ready(struct pcdev_private_data* pcdev_data, const struct pcd_watermark* wm) {
+
+	unsigned nr = READ_ONCE(pcdev_data->nr_records);
+	unsigned used = READ_ONCE(pcdev_data->used);
+
+	if(!nr)
+		return false;
+	if(wm->lowat_records && nr >= wm->lowat_records)
+		return true;
+	if(wm->lowat_bytes && used - nr * PCD_REC_HDR_SIZE >= wm->lowat_bytes)
+		return true;
+	if(wm->hiwat_bytes && used >= wm->hiwat_bytes)
+		return true;
+	return READ_ONCE(pcdev_data->wm_expired);
+}
+
+static enum hrtimer_restart pcd_wm_timer_fn(struct hrtimer* timer) {
+
+	struct pcdev_private_data* pcdev_data = container_of(timer, struct pcdev_private_data, wm_timer);
+
+	WRITE_ONCE(pcdev_data->wm_expired, true);
+	atomic64_inc(&pcdev_data->wakeups_timer);
+	wake_up_interruptible(&pcdev_data->rd_wq);
+	return HRTIMER_NORESTART;
+}
+
+/* Wake readers after a message was queued or coalesce the wakeup, called with lock held */
+static void pcd_record_notify(struct pcdev_private_data* pcdev_data) {
+
+	const struct pcd_watermark* wm = &pcdev_data->wm_eff;
+
+	if(pcd_record_ready(pcdev_data, wm)) {
+		hrtimer_try_to_cancel(&pcdev_data->wm_timer);
+		if(wq_has_sleeper(&pcdev_data->rd_wq)) {
+			atomic64_inc(&pcdev_data->wakeups);
+			wake_up_interruptible(&pcdev_data->rd_wq);
+		}
+		return;
+	}
+
+	atomic64_inc(&pcdev_data->wakeups_coalesced);
+	/* the first message of a batch arms the latency bound */
+	if(wm->max_latency_us && !hrtimer_active(&pcdev_data->wm_timer))
+		hrtimer_start(&pcdev_data->wm_timer, us_to_ktime(wm->max_latency_us), HRTIMER_MODE_REL);
+}
+
+/* Validate and store a watermark, called with lock held */
+static int pcd_wm_apply(struct pcdev_private_data* pcdev_data, struct pcd_watermark* dst, const struct pcd_watermark* src) {
+
+	if(src->hiwat_bytes > pcdev_data->size || src->lowat_bytes > pcdev_data->size)
+		return -EINVAL;
+
+	*dst = *src;
+	dst->flags = 0;
+	dst->pad = 0;
+	/* a reader always needs some way to be woken */
+	if(!dst->lowat_bytes && !dst->lowat_records)
+		dst->lowat_records = 1;
+
+	pcd_wm_recalc(pcdev_data);
+	return 0;
+}
+
+/*
+	Busy poll
+	A blocked reader spins for a short budget before it goes to sleep, which
+	saves the wakeup and context switch when messages arrive back to back.
+	Adaptive polling only spins when the next message is expected, from the
+	average inter-arrival time, to show up within the budget.
+	Returns true if the reader's watermark was reached while spinning.
+*/
+static bool pcd_busy_poll(struct pcdev_private_data* pcdev_data, struct pcd_file_data* fdata) {
+
+	u32 usecs = pcdev_data->busy_poll_us;
+	bool adaptive = pcdev_data->busy_poll_adaptive;
+	u64 budget, start, now, gap, last, next;
+
+	if(fdata->busy_poll_set) {
+		usecs = fdata->busy_poll_us;
+		adaptive = fdata->busy_poll_adaptive;
+	}
+	if(!usecs)
+		return false;
+
+	budget = (u64)usecs * NSEC_PER_USEC;
+	start = ktime_get_ns();
+
+	if(adaptive) {
+		gap = READ_ONCE(pcdev_data->arrival_gap_ns);
+		last = READ_ONCE(pcdev_data->last_arrival_ns);
+		next = last + gap;
+		/*
+			Skip when the next message is not expected within the budget,
+			or when the stream went quiet : several gaps have passed
+			without a message and the prediction no longer holds.
+		*/
+		if(gap && (next > start + budget ||
+			   (start > last && start - last > PCD_BUSY_POLL_IDLE_GAPS * gap))) {
+			atomic64_inc(&pcdev_data->busy_poll_skipped);
+			return false;
+		}
+	}
+
+	atomic64_inc(&pcdev_data->busy_poll_attempts);
+	now = start;
+	while(!pcd_record_ready(pcdev_data, pcd_file_wm(fdata))) {
+		if(now - start >= budget || need_resched() || signal_pending(current)) {
+			atomic64_add(now - start, &pcdev_data->busy_poll_ns);
+			atomic64_inc(&pcdev_data->busy_poll_misses);
+			return false;
+		}
+		cpu_relax();
+		now = ktime_get_ns();
+	}
+
+	atomic64_add(now - start, &pcdev_data->busy_poll_ns);
+	atomic64_inc(&pcdev_data->busy_poll_hits);
+	return true;
+}
+
+/* Track the average message inter-arrival time, called with lock held */
+static void pcd_record_arrival(struct pcdev_private_data* pcdev_data) {
+
+	u64 now = ktime_get_ns();
+	u64 gap = pcdev_data->arrival_gap_ns;
+
+	if(pcdev_data->last_arrival_ns) {
+		/* EWMA with a weight of 1/8 for the newest sample */
+		if(gap)
+			gap = gap - (gap >> 3) + ((now - pcdev_data->last_arrival_ns) >> 3);
+		else
+			gap = now - pcdev_data->last_arrival_ns;
+		WRITE_ONCE(pcdev_data->arrival_gap_ns, gap);
+	}
+	WRITE_ONCE(pcdev_data->last_arrival_ns, now);
+}
+
+/*
+	Take the device lock once messages are available : any message for a non
+	blocking reader, enough messages for the reader's watermark otherwise.
+	Returns 0 with the lock held, or an error with the lock released.
+*/
+static int pcd_record_lock_readable(struct file* file, bool nonblock) {
+
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+
+	for(;;) {
+		if(mutex_lock_interruptible(&pcdev_data->lock))
+			return -ERESTARTSYS;
+		if(nonblock ? pcdev_data->nr_records : pcd_record_ready(pcdev_data, pcd_file_wm(fdata)))
+			return 0;
+		mutex_unlock(&pcdev_data->lock);
+
+		if(nonblock)
+			return -EAGAIN;
+		if(pcd_busy_poll(pcdev_data, fdata))
+			continue;
+		if(wait_event_interruptible(pcdev_data->rd_wq, pcd_record_ready(pcdev_data, pcd_file_wm(fdata))))
+			return -ERESTARTSYS;
+	}
+}
+
+/* Same as above for writers waiting for need bytes of free space */
+static int pcd_record_lock_writable(struct pcdev_private_data* pcdev_data, unsigned need, bool nonblock) {
+
+	for(;;) {
+		if(mutex_lock_interruptible(&pcdev_data->lock))
+			return -ERESTARTSYS;
+		/* a ring shrunk below need is reported by the caller */
+		if(pcdev_data->size - pcdev_data->used >= need || pcdev_data->size < need)
+			return 0;
+		mutex_unlock(&pcdev_data->lock);
+
+		if(nonblock)
+			return -EAGAIN;
+		if(wait_event_interruptible(pcdev_data->wr_wq,
+				READ_ONCE(pcdev_data->size) - READ_ONCE(pcdev_data->used) >= need ||
+				READ_ONCE(pcdev_data->size) < need))
+			return -ERESTARTSYS;
+	}
+}
+
+/*
+	Read filters
+	A BPF_PROG_TYPE_SOCKET_FILTER program attached to an open file sees the
+	payload of each record as the data of an skb, the way a socket filter
+	sees a packet, so the verifier bounds its accesses. Its return value is
+	the number of bytes to deliver : 0 drops the record, less than the
+	payload length truncates it.
+*/
+static u32 pcd_filter_run(struct bpf_prog* filter, struct sk_buff* skb) {
+
+	u32 keep;
+
+	/* map helpers expect an RCU read side section, like sk_filter_trim_cap() */
+	rcu_read_lock();
+	keep = bpf_prog_run_pin_on_cpu(filter, skb);
+	rcu_read_unlock();
+
+	return min(keep, skb->len);
+}
+
+/* Remove the message at the head of the ring, called with lock held */
+static void pcd_record_consume(struct pcdev_private_data* pcdev_data, u32 len) {
+
+	pcdev_data->head = (pcdev_data->head + PCD_REC_HDR_SIZE + len) % pcdev_data->size;
+	pcdev_data->used -= PCD_REC_HDR_SIZE + len;
+	pcdev_data->nr_records--;
+	/* the latency bound restarts with the next batch */
+	if(!pcdev_data->nr_records)
+		WRITE_ONCE(pcdev_data->wm_expired, false);
+}
+
+/*
+	Dequeue the message at the head of the ring into buff, called with lock held.
+	A message larger than size stays queued and -EMSGSIZE is returned.
+	Messages dropped by the file's filter are removed, -EAGAIN is returned
+	if that empties the ring.
+*/
+static ssize_t pcd_record_dequeue(struct pcd_file_data* fdata, char __user* buff, size_t size) {
+
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+	struct bpf_prog* filter = rcu_dereference_protected(fdata->filter, lockdep_is_held(&pcdev_data->lock));
+	struct sk_buff* skb = NULL;
+	u32 len, keep;
+	ssize_t ret;
+
+	while(pcdev_data->nr_records) {
+		pcd_ring_peek(pcdev_data, pcdev_data->head, &len, PCD_REC_HDR_SIZE);
+		keep = len;
+		if(filter) {
+			skb = alloc_skb(len, GFP_KERNEL);
+			if(!skb)
+				return -ENOMEM;
+			pcd_ring_peek(pcdev_data, (pcdev_data->head + PCD_REC_HDR_SIZE) % pcdev_data->size,
+				      skb_put(skb, len), len);
+			keep = pcd_filter_run(filter, skb);
+			if(!keep) {
+				consume_skb(skb);
+				skb = NULL;
+				pcd_record_consume(pcdev_data, len);
+				cond_resched();
+				continue;
+			}
+		}
+		if(keep > size) {
+			ret = -EMSGSIZE;
+			goto out;
+		}
+
+		/* the payload was copied for the filter already */
+		if(skb)
+			ret = copy_to_user(buff, skb->data, keep) ? -EFAULT : 0;
+		else
+			ret = pcd_ring_copy_to_user(pcdev_data, (pcdev_data->head + PCD_REC_HDR_SIZE) % pcdev_data->size, buff, len);
+		if(ret)
+			goto out;
+
+		pcd_record_consume(pcdev_data, len);
+		ret = keep;
+		goto out;
+	}
+	ret = -EAGAIN;
+
+out:
+	consume_skb(skb);
+	return ret;
+}
+
+static ssize_t pcd_record_read(struct file* file, char __user* buff, size_t size, loff_t* offset) {
+
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+	bool nonblock = file->f_flags & O_NONBLOCK;
+	ssize_t ret;
+
+	for(;;) {
+		ret = pcd_record_lock_readable(file, nonblock);
+		if(ret)
+			return ret;
+
+		ret = pcd_record_dequeue(fdata, buff, size);
+		mutex_unlock(&pcdev_data->lock);
+
+		if(ret >= 0 || ret == -EAGAIN)
+			wake_up_interruptible(&pcdev_data->wr_wq);
+		/* the filter dropped every queued message, wait for more */
+		if(ret != -EAGAIN || nonblock)
+			return ret;
+	}
+}
+
+static ssize_t pcd_record_write(struct file* file, const char __user* buff, size_t size, loff_t* offset) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	u32 len = size;
+	ssize_t ret;
+
+	/* the message can never fit in the ring */
+	if(size > pcdev_data->size - PCD_REC_HDR_SIZE)
+		return -EMSGSIZE;
+
+	ret = pcd_record_lock_writable(pcdev_data, PCD_REC_HDR_SIZE + len, file->f_flags & O_NONBLOCK);
+	if(ret)
+		return ret;
+	/* the ring may have been shrunk while we waited */
+	if(PCD_REC_HDR_SIZE + len > pcdev_data->size) {
+		ret = -EMSGSIZE;
+		goto unlock;
+	}
+
+	/* the message is only published once the payload has been copied */
+	ret = pcd_ring_copy_from_user(pcdev_data, (pcdev_data->tail + PCD_REC_HDR_SIZE) % pcdev_data->size, buff, len);
+	if(ret)
+		goto unlock;
+	pcd_ring_poke(pcdev_data, pcdev_data->tail, &len, PCD_REC_HDR_SIZE);
+
+	pcdev_data->tail = (pcdev_data->tail + PCD_REC_HDR_SIZE + len) % pcdev_data->size;
+	pcdev_data->used += PCD_REC_HDR_SIZE + len;
+	pcdev_data->nr_records++;
+	pcd_record_arrival(pcdev_data);
+	pcd_record_notify(pcdev_data);
+	ret = len;
+
+unlock:
+	mutex_unlock(&pcdev_data->lock);
+	return ret;
+}
+
+/* Dequeue up to batch.vlen messages with a single call */
+static long pcd_record_recv_batch(struct file* file, struct pcd_mmsg_batch __user* ubatch) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_mmsg __user* umsgs;
+	struct pcd_mmsg_batch batch;
+	struct pcd_mmsg msg;
+	bool nonblock;
+	unsigned i;
+	ssize_t ret;
+
+	if(pcdev_data->mode != PCD_MODE_RECORD)
+		return -EINVAL;
+	if(!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if(copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if(!batch.vlen)
+		return 0;
+	if(batch.vlen > PCD_MMSG_MAX)
+		batch.vlen = PCD_MMSG_MAX;
+	umsgs = u64_to_user_ptr(batch.msgs);
+
+	nonblock = (file->f_flags & O_NONBLOCK) || (batch.flags & PCD_MSG_DONTWAIT);
+
+again:
+	/* only the first message may block */
+	ret = pcd_record_lock_readable(file, nonblock);
+	if(ret)
+		return ret;
+
+	for(i = 0; i < batch.vlen && pcdev_data->nr_records; i++) {
+		if(copy_from_user(&msg, &umsgs[i], sizeof(msg))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = pcd_record_dequeue(file->private_data, u64_to_user_ptr(msg.buf), msg.len);
+		if(ret < 0)
+			break;
+		if(put_user((u32)ret, &umsgs[i].msg_len)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	mutex_unlock(&pcdev_data->lock);
+
+	if(i || ret == -EAGAIN)
+		wake_up_interruptible(&pcdev_data->wr_wq);
+	/* the filter dropped every queued message, wait for more */
+	if(!i && ret == -EAGAIN && !nonblock)
+		goto again;
+
+	/* report the messages received before an error, like recvmmsg */
+	return i ? i : ret;
+}
+
+/*
+	Log mode
+	The buffer holds an append-only log : each write() becomes one record,
+	a struct pcd_log_hdr followed by the payload, appended at log_tail.
+	Records never move and are never overwritten, so readers walk the log
+	without the lock, up to the log_tail they loaded with acquire semantics.
+	A sparse index of every PCD_LOG_STRIDE-th record offset lets seeks by
+	sequence number or timestamp binary search instead of scanning.
+*/
+static inline unsigned pcd_log_rec_size(u32 len) {
+
+	return ALIGN(PCD_LOG_HDR_SIZE + len, PCD_LOG_ALIGN);
+}
+
+/*
+	Load the payload length of the record at pos, which must be below tail.
+	Records written by pcd_log_write() always fit before the tail, one that
+	does not was overwritten after the log was switched away under a
+	lockless reader and must not be trusted.
+*/
+static bool pcd_log_rec_len(const char* data, unsigned pos, unsigned tail, u32* len) {
+
+	if(tail - pos < PCD_LOG_HDR_SIZE)
+		return false;
+	*len = READ_ONCE(((const struct pcd_log_hdr*)(data + pos))->len);
+	return *len <= tail - pos - PCD_LOG_HDR_SIZE;
+}
+
+static int pcd_log_create(struct pcdev_private_data* pcdev_data) {
+
+	/* enough entries for a log of empty records */
+	unsigned nr = pcdev_data->size / PCD_LOG_HDR_SIZE / PCD_LOG_STRIDE + 1;
+
+	pcdev_data->log_index = kvcalloc(nr, sizeof(u32), GFP_KERNEL_ACCOUNT);
+	if(!pcdev_data->log_index)
+		return -ENOMEM;
+	pcdev_data->log_tail = 0;
+	pcdev_data->log_seq = 0;
+	pcdev_data->log_last_ns = 0;
+	return 0;
+}
+
+static void pcd_log_destroy(struct pcdev_private_data* pcdev_data) {
+
+	kvfree(pcdev_data->log_index);
+	pcdev_data->log_index = NULL;
+	pcdev_data->log_tail = 0;
+	pcdev_data->log_seq = 0;
+}
+
+static ssize_t pcd_log_write(struct file* file, const char __user* buff, size_t size, loff_t* offset) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_log_hdr* hdr;
+	unsigned tail, need;
+	ssize_t ret;
+
+	if(!size)
+		return 0;
+	/* the record can never fit in the log */
+	if(size > pcdev_data->size - PCD_LOG_HDR_SIZE)
+		return -EMSGSIZE;
+
+	if(mutex_lock_interruptible(&pcdev_data->lock))
+		return -ERESTARTSYS;
+	if(pcdev_data->mode != PCD_MODE_LOG) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	/* every record lands at the tail whatever the file offset, O_APPEND style */
+	tail = pcdev_data->log_tail;
+	need = pcd_log_rec_size(size);
+	if(need > pcdev_data->size - tail) {
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	hdr = (struct pcd_log_hdr*)(pcd_bk(pcdev_data)->data + tail);
+	if(copy_from_user(hdr + 1, buff, size)) {
+		ret = -EFAULT;
+		goto unlock;
+	}
+	/* wall clock time, kept monotonic so that the log stays sorted by time */
+	pcdev_data->log_last_ns = max(ktime_get_real_ns(), pcdev_data->log_last_ns);
+	hdr->seq = pcdev_data->log_seq;
+	hdr->ts_ns = pcdev_data->log_last_ns;
+	hdr->len = size;
+	hdr->pad = 0;
+	if(!(pcdev_data->log_seq % PCD_LOG_STRIDE))
+		pcdev_data->log_index[pcdev_data->log_seq / PCD_LOG_STRIDE] = tail;
+	pcdev_data->log_seq++;
+
+	/* readers see the record once the tail covers it */
+	smp_store_release(&pcdev_data->log_tail, tail + need);
+	ret = size;
+
+unlock:
+	mutex_unlock(&pcdev_data->lock);
+	if(ret > 0 && wq_has_sleeper(&pcdev_data->rd_wq))
+		wake_up_interruptible(&pcdev_data->rd_wq);
+	return ret;
+}
+
+/*
+	Read the record at the file's log position, header included. Returns 0
+	at the end of the log, and -EMSGSIZE without consuming the record if it
+	does not fit in size.
+*/
+static ssize_t pcd_log_read(struct file* file, char __user* buff, size_t size, loff_t* offset) {
+
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+	unsigned tail = smp_load_acquire(&pcdev_data->log_tail);
+	unsigned pos = READ_ONCE(fdata->log_pos);
+	struct pcd_log_hdr* hdr;
+	struct pcd_log_hdr out;
+	struct pcd_backing* bk;
+	struct bpf_prog* filter;
+	struct sk_buff* skb = NULL;
+	ssize_t ret = 0;
+	u32 len;
+
+	if(pos >= tail)
+		return 0;
+
+	/* hold the filter without the lock, a detached one goes away after a grace period */
+	rcu_read_lock();
+	filter = rcu_dereference(fdata->filter);
+	if(filter && IS_ERR(bpf_prog_inc_not_zero(filter)))
+		filter = NULL;
+	rcu_read_unlock();
+
+	/* a NUMA migration may replace the backing, the copy holds the same log */
+	bk = pcd_backing_get(pcdev_data);
+	/* the buffer may have been resized after the log was switched away */
+	tail = min(tail, bk->size);
+	for(; pos < tail; pos += pcd_log_rec_size(len)) {
+		if(!pcd_log_rec_len(bk->data, pos, tail, &len)) {
+			ret = -EIO;
+			break;
+		}
+		hdr = (struct pcd_log_hdr*)(bk->data + pos);
+		out = *hdr;
+		out.len = len;
+		if(filter) {
+			skb = alloc_skb(len, GFP_KERNEL);
+			if(!skb) {
+				ret = -ENOMEM;
+				break;
+			}
+			skb_put_data(skb, hdr + 1, len);
+			out.len = pcd_filter_run(filter, skb);
+			if(!out.len) {
+				consume_skb(skb);
+				skb = NULL;
+				cond_resched();
+				continue;
+			}
+		}
+
+		/* the record stays unread, dropped records before it are skipped */
+		if(PCD_LOG_HDR_SIZE + out.len > size) {
+			ret = -EMSGSIZE;
+			break;
+		}
+		if(copy_to_user(buff, &out, PCD_LOG_HDR_SIZE) ||
+		   copy_to_user(buff + PCD_LOG_HDR_SIZE, skb ? skb->data : (void*)(hdr + 1), out.len)) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = PCD_LOG_HDR_SIZE + out.len;
+		pos += pcd_log_rec_size(len);
+		break;
+	}
+	WRITE_ONCE(fdata->log_pos, pos);
+
+	consume_skb(skb);
+	pcd_backing_put(bk);
+	if(filter)
+		bpf_prog_put(filter);
+	return ret;
+}
+
+static __poll_t pcd_log_poll(struct file* file, struct poll_table_struct* wait) {
+
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(file, &pcdev_data->rd_wq, wait);
+	if(READ_ONCE(fdata->log_pos) < smp_load_acquire(&pcdev_data->log_tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	return mask;
+}
+
+/*
+	Find the first record whose sequence number (PCD_LOG_SEEK_SEQ) or
+	timestamp (PCD_LOG_SEEK_TIME) is at least key, called with lock held.
+	Returns its offset and sequence number, or the tail and the next
+	sequence number if there is none.
+*/
+static unsigned pcd_log_find(struct pcdev_private_data* pcdev_data, u32 by, u64 key, u64* seq) {
+
+	const char* data = pcd_bk(pcdev_data)->data;
+	unsigned nr = DIV_ROUND_UP(pcdev_data->log_seq, PCD_LOG_STRIDE);
+	const struct pcd_log_hdr* hdr;
+	unsigned lo = 0, hi = nr, i, off;
+	u32 len;
+	u64 s;
+
+	if(by == PCD_LOG_SEEK_SEQ) {
+		i = min_t(u64, key, pcdev_data->log_seq) / PCD_LOG_STRIDE;
+	} else {
+		/* first indexed record not older than key, the match is at most one stride before it */
+		while(lo < hi) {
+			i = lo + (hi - lo) / 2;
+			hdr = (const struct pcd_log_hdr*)(data + pcdev_data->log_index[i]);
+			if(hdr->ts_ns < key)
+				lo = i + 1;
+			else
+				hi = i;
+		}
+		i = lo ? lo - 1 : 0;
+	}
+
+	if(i >= nr) {
+		*seq = pcdev_data->log_seq;
+		return pcdev_data->log_tail;
+	}
+
+	/* walk at most one stride of records */
+	off = pcdev_data->log_index[i];
+	s = (u64)i * PCD_LOG_STRIDE;
+	while(off < pcdev_data->log_tail) {
+		if(!pcd_log_rec_len(data, off, pcdev_data->log_tail, &len))
+			break;
+		hdr = (const struct pcd_log_hdr*)(data + off);
+		if(by == PCD_LOG_SEEK_SEQ ? hdr->seq >= key : hdr->ts_ns >= key)
+			break;
+		off += pcd_log_rec_size(len);
+		s++;
+	}
+
+	*seq = s;
+	return off;
+}
+
+static long pcd_log_seek(struct file* file, struct pcd_log_seek __user* useek) {
+
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+	struct pcd_log_seek seek;
+	unsigned pos;
+
+	if(copy_from_user(&seek, useek, sizeof(seek)))
+		return -EFAULT;
+	if(seek.by != PCD_LOG_SEEK_SEQ && seek.by != PCD_LOG_SEEK_TIME)
+		return -EINVAL;
+
+	if(mutex_lock_interruptible(&pcdev_data->lock))
+		return -ERESTARTSYS;
+	if(pcdev_data->mode != PCD_MODE_LOG) {
+		mutex_unlock(&pcdev_data->lock);
+		return -EINVAL;
+	}
+	pos = pcd_log_find(pcdev_data, seek.by, seek.key, &seek.seq);
+	mutex_unlock(&pcdev_data->lock);
+
+	WRITE_ONCE(fdata->log_pos, pos);
+	return put_user(seek.seq, &useek->seq);
+}
+
+/*
+	Key-value mode
+	Entries live in an rhashtable and are looked up under RCU without taking
+	the device lock, a reference keeps an entry alive while its value is
+	copied out. Values are allocated from a genalloc arena covering the
+	device buffer. Updates are serialized by the device lock.
+	Every entry takes at least one granule of the arena, even with an empty
+	value, so the number of keys is bounded by the device size as well.
+*/
+struct pcd_kv_entry {
+
+	struct rhash_head node;
+	struct pcd_kv_key key;
+	refcount_t ref;
+	struct pcd_kv* kv;
+	u32 len;
+	char* val;
+	struct rcu_head rcu;
+
+};
+
+static struct kmem_cache* pcd_kv_cache;
+
+/* arena bytes held by an entry */
+static inline size_t pcd_kv_val_size(u32 len) {
+
+	return max_t(size_t, len, 1);
+}
+
+static const struct rhashtable_params pcd_kv_params = {
+	.head_offset = offsetof(struct pcd_kv_entry, node),
+	.key_offset = offsetof(struct pcd_kv_entry, key),
+	.key_len = sizeof(struct pcd_kv_key),
+	.automatic_shrinking = true,
+};
+
+static void pcd_kv_entry_free_rcu(struct rcu_head* rcu) {
+
+	kmem_cache_free(pcd_kv_cache, container_of(rcu, struct pcd_kv_entry, rcu));
+}
+
+static void pcd_kv_entry_put(struct pcd_kv_entry* e) {
+
+	struct pcd_kv* kv = e->kv;
+
+	if(!refcount_dec_and_test(&e->ref))
+		return;
+
+	gen_pool_free(kv->arena, (unsigned long)e->val, pcd_kv_val_size(e->len));
+	/* lockless lookups may still see the entry until a grace period passes */
+	call_rcu(&e->rcu, pcd_kv_entry_free_rcu);
+
+	if(atomic_dec_and_test(&kv->nr_entries))
+		wake_up_var(&kv->nr_entries);
+}
+
+static void pcd_kv_entry_put_ht(void* ptr, void* arg) {
+
+	pcd_kv_entry_put(ptr);
+}
+
+/* Copy a key from user space, unused key bytes are zeroed so keys compare with memcmp */
+static int pcd_kv_get_key(struct pcd_kv_key* key, const struct pcd_kv_key __user* ukey) {
+
+	if(copy_from_user(key, ukey, sizeof(*key)))
+		return -EFAULT;
+	if(!key->len || key->len > PCD_KV_KEY_MAX)
+		return -EINVAL;
+	memset(key->data + key->len, 0, PCD_KV_KEY_MAX - key->len);
+	return 0;
+}
+
+/* Lockless lookup, returns a referenced entry */
+static struct pcd_kv_entry* pcd_kv_lookup(struct pcdev_private_data* pcdev_data, const struct pcd_kv_key* key) {
+
+	struct pcd_kv_entry* e = NULL;
+	struct pcd_kv* kv;
+
+	rcu_read_lock();
+	kv = rcu_dereference(pcdev_data->kv);
+	if(kv)
+		e = rhashtable_lookup(&kv->ht, key, pcd_kv_params);
+	if(e && !refcount_inc_not_zero(&e->ref))
+		e = NULL;
+	rcu_read_unlock();
+
+	return e;
+}
+
+/* Copy the value of op->key to user space, updating op->val_len */
+static int pcd_kv_do_get(struct pcdev_private_data* pcdev_data, struct pcd_kv_op* op) {
+
+	struct pcd_kv_entry* e;
+	int ret = 0;
+
+	e = pcd_kv_lookup(pcdev_data, &op->key);
+	if(!e)
+		return -ENOENT;
+
+	if(e->len > op->val_len)
+		ret = -EMSGSIZE;
+	else if(copy_to_user(u64_to_user_ptr(op->val), e->val, e->len))
+		ret = -EFAULT;
+	op->val_len = e->len;
+
+	pcd_kv_entry_put(e);
+	return ret;
+}
+
+static long pcd_kv_get(struct file* file, struct pcd_kv_op __user* uop) {
+
+	struct pcd_kv_op op;
+	long ret;
+
+	if(!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if(pcd_file_dev(file)->mode != PCD_MODE_KV)
+		return -EINVAL;
+	ret = pcd_kv_get_key(&op.key, &uop->key);
+	if(ret)
+		return ret;
+	if(copy_from_user(&op.val_len, &uop->val_len, sizeof(op.val_len)) ||
+	   copy_from_user(&op.val, &uop->val, sizeof(op.val)))
+		return -EFAULT;
+
+	ret = pcd_kv_do_get(pcd_file_dev(file), &op);
+	if((!ret || ret == -EMSGSIZE) && put_user(op.val_len, &uop->val_len))
+		return -EFAULT;
+	return ret;
+}
+
+static long pcd_kv_mget(struct file* file, struct pcd_kv_batch __user* ubatch) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_kv_op __user* uops;
+	struct pcd_kv_batch batch;
+	struct pcd_kv_op op;
+	unsigned i;
+
+	if(!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if(pcdev_data->mode != PCD_MODE_KV)
+		return -EINVAL;
+	if(copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if(batch.nr > PCD_KV_BATCH_MAX)
+		return -EINVAL;
+	uops = u64_to_user_ptr(batch.ops);
+
+	for(i = 0; i < batch.nr; i++) {
+		if(copy_from_user(&op, &uops[i], sizeof(op)))
+			return -EFAULT;
+		op.result = -EINVAL;
+		if(op.key.len && op.key.len <= PCD_KV_KEY_MAX) {
+			memset(op.key.data + op.key.len, 0, PCD_KV_KEY_MAX - op.key.len);
+			op.result = pcd_kv_do_get(pcdev_data, &op);
+		}
+		if(put_user(op.val_len, &uops[i].val_len) || put_user(op.result, &uops[i].result))
+			return -EFAULT;
+	}
+	return 0;
+}
+
+static long pcd_kv_put(struct file* file, struct pcd_kv_op __user* uop) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_kv_entry *e, *old;
+	struct pcd_kv* kv;
+	struct pcd_kv_op op;
+	long ret;
+
+	if(!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(copy_from_user(&op, uop, sizeof(op)))
+		return -EFAULT;
+	ret = pcd_kv_get_key(&op.key, &uop->key);
+	if(ret)
+		return ret;
+	if(op.flags & ~PCD_KV_NOREPLACE)
+		return -EINVAL;
+	if(op.val_len > pcdev_data->size)
+		return -EMSGSIZE;
+
+	if(mutex_lock_interruptible(&pcdev_data->lock))
+		return -ERESTARTSYS;
+	kv = rcu_dereference_protected(pcdev_data->kv, lockdep_is_held(&pcdev_data->lock));
+	if(!kv) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	e = kmem_cache_zalloc(pcd_kv_cache, GFP_KERNEL);
+	if(!e) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+	e->key = op.key;
+	e->kv = kv;
+	e->len = op.val_len;
+	refcount_set(&e->ref, 1);
+	e->val = (char*)gen_pool_alloc(kv->arena, pcd_kv_val_size(e->len));
+	if(!e->val) {
+		kmem_cache_free(pcd_kv_cache, e);
+		ret = -ENOSPC;
+		goto unlock;
+	}
+	atomic_inc(&kv->nr_entries);
+
+	if(copy_from_user(e->val, u64_to_user_ptr(op.val), e->len)) {
+		ret = -EFAULT;
+		goto put_entry;
+	}
+
+	/* the new value is complete before lookups can find it */
+	old = rhashtable_lookup_fast(&kv->ht, &e->key, pcd_kv_params);
+	if(old && (op.flags & PCD_KV_NOREPLACE)) {
+		ret = -EEXIST;
+		goto put_entry;
+	}
+	if(old) {
+		ret = rhashtable_replace_fast(&kv->ht, &old->node, &e->node, pcd_kv_params);
+		if(!ret)
+			pcd_kv_entry_put(old);
+	} else {
+		ret = rhashtable_insert_fast(&kv->ht, &e->node, pcd_kv_params);
+	}
+	if(ret)
+		goto put_entry;
+
+	mutex_unlock(&pcdev_data->lock);
+	return 0;
+
+put_entry:
+	pcd_kv_entry_put(e);
+unlock:
+	mutex_unlock(&pcdev_data->lock);
+	return ret;
+}
+
+static long pcd_kv_del(struct file* file, struct pcd_kv_key __user* ukey) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_kv_entry* e;
+	struct pcd_kv_key key;
+	struct pcd_kv* kv;
+	long ret;
+
+	if(!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	ret = pcd_kv_get_key(&key, ukey);
+	if(ret)
+		return ret;
+
+	if(mutex_lock_interruptible(&pcdev_data->lock))
+		return -ERESTARTSYS;
+	kv = rcu_dereference_protected(pcdev_data->kv, lockdep_is_held(&pcdev_data->lock));
+	e = kv ? rhashtable_lookup_fast(&kv->ht, &key, pcd_kv_params) : NULL;
+	if(!e)
+		ret = kv ? -ENOENT : -EINVAL;
+	else if(!(ret = rhashtable_remove_fast(&kv->ht, &e->node, pcd_kv_params)))
+		pcd_kv_entry_put(e);
+	mutex_unlock(&pcdev_data->lock);
+
+	return ret;
+}
+
+/*
+	Return up to iter.max keys starting at the cursor. The cursor counts the
+	keys already returned, keys put or deleted in between may be missed or
+	returned twice.
+*/
+static long pcd_kv_iter(struct file* file, struct pcd_kv_iter __user* uiter) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct rhashtable_iter hti;
+	struct pcd_kv_entry* e;
+	struct pcd_kv_iter iter;
+	struct pcd_kv_key* keys;
+	struct pcd_kv* kv;
+	u64 skip;
+	long ret = 0;
+
+	if(!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if(copy_from_user(&iter, uiter, sizeof(iter)))
+		return -EFAULT;
+	iter.max = min_t(u32, iter.max, PCD_KV_BATCH_MAX);
+	iter.count = 0;
+
+	keys = kvmalloc_array(iter.max, sizeof(*keys), GFP_KERNEL);
+	if(iter.max && !keys)
+		return -ENOMEM;
+
+	/* holding the lock keeps the table alive, lookups are not blocked by it */
+	if(mutex_lock_interruptible(&pcdev_data->lock)) {
+		kvfree(keys);
+		return -ERESTARTSYS;
+	}
+	kv = rcu_dereference_protected(pcdev_data->kv, lockdep_is_held(&pcdev_data->lock));
+	if(!kv) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	rhashtable_walk_enter(&kv->ht, &hti);
+	rhashtable_walk_start(&hti);
+	skip = iter.pos;
+	while(iter.count < iter.max && (e = rhashtable_walk_next(&hti))) {
+		if(IS_ERR(e)) {
+			/* the table was resized under us, keep walking */
+			if(PTR_ERR(e) == -EAGAIN)
+				continue;
+			break;
+		}
+		if(skip) {
+			skip--;
+			continue;
+		}
+		keys[iter.count++] = e->key;
+	}
+	rhashtable_walk_stop(&hti);
+	rhashtable_walk_exit(&hti);
+
+	iter.pos += iter.count;
+
+unlock:
+	mutex_unlock(&pcdev_data->lock);
+
+	if(!ret && (copy_to_user(u64_to_user_ptr(iter.keys), keys, iter.count * sizeof(*keys)) ||
+		    copy_to_user(uiter, &iter, sizeof(iter))))
+		ret = -EFAULT;
+	kvfree(keys);
+	return ret;
+}
+
+/* Set up the key-value store over the device buffer, called with lock held */
+static int pcd_kv_create(struct pcdev_private_data* pcdev_data) {
+
+	struct pcd_backing* bk = pcd_bk(pcdev_data);
+	struct pcd_kv* kv;
+	int ret;
+
+	kv = kzalloc_node(sizeof(*kv), GFP_KERNEL, bk->node);
+	if(!kv)
+		return -ENOMEM;
+
+	ret = rhashtable_init(&kv->ht, &pcd_kv_params);
+	if(ret)
+		goto free_kv;
+
+	kv->arena = gen_pool_create(PCD_KV_ARENA_ORDER, bk->node);
+	if(!kv->arena) {
+		ret = -ENOMEM;
+		goto destroy_ht;
+	}
+	ret = gen_pool_add(kv->arena, (unsigned long)bk->data, pcdev_data->size, bk->node);
+	if(ret)
+		goto destroy_arena;
+
+	rcu_assign_pointer(pcdev_data->kv, kv);
+	return 0;
+
+destroy_arena:
+	gen_pool_destroy(kv->arena);
+destroy_ht:
+	rhashtable_destroy(&kv->ht);
+free_kv:
+	kfree(kv);
+	return ret;
+}
+
+/* Tear down the key-value store, called with lock held */
+static void pcd_kv_destroy(struct pcdev_private_data* pcdev_data) {
+
+	struct pcd_kv* kv = rcu_replace_pointer(pcdev_data->kv, NULL, lockdep_is_held(&pcdev_data->lock));
+
+	if(!kv)
+		return;
+
+	/* no new lookups after this, then wait for the ones holding entries */
+	synchronize_rcu();
+	rhashtable_free_and_destroy(&kv->ht, pcd_kv_entry_put_ht, NULL);
+	wait_var_event(&kv->nr_entries, !atomic_read(&kv->nr_entries));
+
+	gen_pool_destroy(kv->arena);
+	kfree(kv);
+}
+
+static long pcd_set_mode(struct file* file, u32 mode) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+
+	long ret = 0;
+
+	/* switching modes discards the queued data of every user */
+	if(!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(mode != PCD_MODE_STREAM && mode != PCD_MODE_RECORD && mode != PCD_MODE_KV && mode != PCD_MODE_LOG)
+		return -EINVAL;
+	/* the ring needs room for at least one header and one byte */
+	if(mode == PCD_MODE_RECORD && pcdev_data->size <= PCD_REC_HDR_SIZE)
+		return -EINVAL;
+	if(mode == PCD_MODE_LOG && pcdev_data->size < pcd_log_rec_size(1))
+		return -EINVAL;
+
+	if(mutex_lock_interruptible(&pcdev_data->lock))
+		return -ERESTARTSYS;
+	/* nothing to do, and nothing to reset */
+	if(mode == pcdev_data->mode) {
+		mutex_unlock(&pcdev_data->lock);
+		return 0;
+	}
+	/* replicas only follow stream writes, importers expect a flat buffer */
+	if(mode != PCD_MODE_STREAM && (pcdev_data->replicate || pcdev_data->exports)) {
+		mutex_unlock(&pcdev_data->lock);
+		return -EBUSY;
+	}
+	/*
+		Only a sole opener changes the mode : the file operations of the
+		other files were picked for the current one. This also keeps the
+		key-value store from being torn down under its users.
+	*/
+	if(!list_is_singular(&pcdev_data->files)) {
+		mutex_unlock(&pcdev_data->lock);
+		return -EBUSY;
+	}
+	/* a log is only started over when entering log mode, readers may be positioned in it */
+	if(mode == PCD_MODE_LOG) {
+		ret = pcd_log_create(pcdev_data);
+		if(ret) {
+			mutex_unlock(&pcdev_data->lock);
+			return ret;
+		}
+		((struct pcd_file_data*)file->private_data)->log_pos = 0;
+	}
+	if(mode == PCD_MODE_KV || pcdev_data->mode == PCD_MODE_KV) {
+		if(mode == PCD_MODE_KV)
+			ret = pcd_kv_create(pcdev_data);
+		else
+			pcd_kv_destroy(pcdev_data);
+		if(ret) {
+			mutex_unlock(&pcdev_data->lock);
+			return ret;
+		}
+	}
+	if(pcdev_data->mode == PCD_MODE_LOG)
+		pcd_log_destroy(pcdev_data);
+	pcdev_data->mode = mode;
+	/* all tables have the same owner, so the module reference carries over */
+	WRITE_ONCE(file->f_op, pcd_mode_fops(file, mode));
+	pcd_ring_reset(pcdev_data);
+	hrtimer_try_to_cancel(&pcdev_data->wm_timer);
+	pcdev_data->wm_expired = false;
+	mutex_unlock(&pcdev_data->lock);
+
+	wake_up_interruptible(&pcdev_data->wr_wq);
+	MOD_LOGI("%s switched to mode %u", pcdev_data->serial_number, mode);
+	return 0;
+}
+
+/*
+	dma-buf export
+	Page backed buffers are exported as is, importers and mmap users share
+	the pages with pcd_stream_read and pcd_stream_write. The exporter keeps the backing
+	from being replaced while exports exist.
+*/
+struct pcd_dmabuf {
+
+	struct pcdev_private_data* pcdev_data;
+	struct pcd_backing* bk;
+	pgoff_t first;
+	unsigned nr_pages;
+	/* attachments, for cache maintenance in begin/end_cpu_access */
+	struct mutex lock;
+	struct list_head attachments;
+	/* open begin/end_cpu_access brackets of this export, protected by the device lock */
+	unsigned cpu_access;
+
+};
+
+struct pcd_dmabuf_attachment {
+
+	struct device* dev;
+	struct sg_table* sgt;
+	enum dma_data_direction dir;
+	struct list_head node;
+
+};
+
+static int pcd_dmabuf_attach(struct dma_buf* dmabuf, struct dma_buf_attachment* attach) {
+
+	struct pcd_dmabuf* buf = dmabuf->priv;
+	struct pcd_dmabuf_attachment* a;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if(!a)
+		return -ENOMEM;
+	a->dev = attach->dev;
+	attach->priv = a;
+
+	mutex_lock(&buf->lock);
+	list_add(&a->node, &buf->attachments);
+	mutex_unlock(&buf->lock);
+	return 0;
+}
+
+static void pcd_dmabuf_detach(struct dma_buf* dmabuf, struct dma_buf_attachment* attach) {
+
+	struct pcd_dmabuf* buf = dmabuf->priv;
+	struct pcd_dmabuf_attachment* a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	list_del(&a->node);
+	mutex_unlock(&buf->lock);
+	kfree(a);
+}
+
+static struct sg_table* pcd_dmabuf_map(struct dma_buf_attachment* attach, enum dma_data_direction dir) {
+
+	struct pcd_dmabuf* buf = attach->dmabuf->priv;
+	struct pcd_dmabuf_attachment* a = attach->priv;
+	struct sg_table* sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if(!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = sg_alloc_table_from_pages(sgt, buf->bk->pages + buf->first, buf->nr_pages, 0,
+					(size_t)buf->nr_pages << PAGE_SHIFT, GFP_KERNEL);
+	if(ret)
+		goto free_sgt;
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if(ret)
+		goto free_table;
+
+	mutex_lock(&buf->lock);
+	a->sgt = sgt;
+	a->dir = dir;
+	mutex_unlock(&buf->lock);
+	return sgt;
+
+free_table:
+	sg_free_table(sgt);
+free_sgt:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void pcd_dmabuf_unmap(struct dma_buf_attachment* attach, struct sg_table* sgt, enum dma_data_direction dir) {
+
+	struct pcd_dmabuf* buf = attach->dmabuf->priv;
+	struct pcd_dmabuf_attachment* a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	a->sgt = NULL;
+	mutex_unlock(&buf->lock);
+
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+/*
+	CPU access brackets (DMA_BUF_IOCTL_SYNC).
+	Beginning one waits for an in-flight pcd_stream_write and holds off new ones
+	until the bracket ends, so the CPU user sees a stable buffer.
+*/
+static int pcd_dmabuf_begin_cpu_access(struct dma_buf* dmabuf, enum dma_data_direction dir) {
+
+	struct pcd_dmabuf* buf = dmabuf->priv;
+	struct pcdev_private_data* pcdev_data = buf->pcdev_data;
+	struct pcd_dmabuf_attachment* a;
+
+	if(mutex_lock_interruptible(&pcdev_data->lock))
+		return -ERESTARTSYS;
+	buf->cpu_access++;
+	pcdev_data->cpu_access++;
+	mutex_unlock(&pcdev_data->lock);
+
+	/* writes through the kernel mapping must reach the user mappings */
+	flush_kernel_vmap_range(buf->bk->data + (buf->first << PAGE_SHIFT), buf->nr_pages << PAGE_SHIFT);
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, node)
+		if(a->sgt)
+			dma_sync_sgtable_for_cpu(a->dev, a->sgt, a->dir);
+	mutex_unlock(&buf->lock);
+	return 0;
+}
+
+static int pcd_dmabuf_end_cpu_access(struct dma_buf* dmabuf, enum dma_data_direction dir) {
+
+	struct pcd_dmabuf* buf = dmabuf->priv;
+	struct pcdev_private_data* pcdev_data = buf->pcdev_data;
+	struct pcd_dmabuf_attachment* a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, node)
+		if(a->sgt)
+			dma_sync_sgtable_for_device(a->dev, a->sgt, a->dir);
+	mutex_unlock(&buf->lock);
+
+	/* and CPU writes must be visible to pcd_stream_read through the kernel mapping */
+	invalidate_kernel_vmap_range(buf->bk->data + (buf->first << PAGE_SHIFT), buf->nr_pages << PAGE_SHIFT);
+
+	mutex_lock(&pcdev_data->lock);
+	/* CPU writes reach the replicas and waiters on the doorbell like a pcd_stream_write */
+	if(dir != DMA_FROM_DEVICE) {
+		unsigned off = buf->first << PAGE_SHIFT;
+
+		pcd_backing_sync(buf->bk, off, min_t(unsigned, buf->nr_pages << PAGE_SHIFT, pcdev_data->size - off));
+	}
+	/* an end without a begin on this export does not release someone else's bracket */
+	if(buf->cpu_access) {
+		buf->cpu_access--;
+		pcdev_data->cpu_access--;
+	}
+	mutex_unlock(&pcdev_data->lock);
+
+	wake_up_interruptible(&pcdev_data->wr_wq);
+	if(dir != DMA_FROM_DEVICE)
+		pcd_doorbell_wake(pcdev_data);
+	return 0;
+}
+
+static int pcd_dmabuf_mmap(struct dma_buf* dmabuf, struct vm_area_struct* vma) {
+
+	struct pcd_dmabuf* buf = dmabuf->priv;
+
+	return vm_map_pages(vma, buf->bk->pages + buf->first, buf->nr_pages);
+}
+
+static int pcd_dmabuf_vmap(struct dma_buf* dmabuf, struct iosys_map* map) {
+
+	struct pcd_dmabuf* buf = dmabuf->priv;
+
+	/* the buffer is permanently mapped */
+	iosys_map_set_vaddr(map, buf->bk->data + (buf->first << PAGE_SHIFT));
+	return 0;
+}
+
+static void pcd_dmabuf_free(struct pcd_dmabuf* buf) {
+
+	struct pcdev_private_data* pcdev_data = buf->pcdev_data;
+
+	mutex_lock(&pcdev_data->lock);
+	pcdev_data->exports--;
+	/* brackets left open by a user that went away must not block writers forever */
+	pcdev_data->cpu_access -= buf->cpu_access;
+	mutex_unlock(&pcdev_data->lock);
+
+	if(buf->cpu_access)
+		wake_up_interruptible(&pcdev_data->wr_wq);
+	kfree(buf);
+}
+
+static void pcd_dmabuf_release(struct dma_buf* dmabuf) {
+
+	pcd_dmabuf_free(dmabuf->priv);
+}
+
+static const struct dma_buf_ops pcd_dmabuf_ops = {
+	.attach = pcd_dmabuf_attach,
+	.detach = pcd_dmabuf_detach,
+	.map_dma_buf = pcd_dmabuf_map,
+	.unmap_dma_buf = pcd_dmabuf_unmap,
+	.begin_cpu_access = pcd_dmabuf_begin_cpu_access,
+	.end_cpu_access = pcd_dmabuf_end_cpu_access,
+	.mmap = pcd_dmabuf_mmap,
+	.vmap = pcd_dmabuf_vmap,
+	.release = pcd_dmabuf_release,
+};
+
+static long pcd_export_dmabuf(struct file* file, struct pcd_dmabuf_export __user* uexp) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct pcd_dmabuf_export exp;
+	struct dma_buf* dmabuf;
+	struct pcd_dmabuf* buf;
+	long ret;
+	int fd;
+
+	if(copy_from_user(&exp, uexp, sizeof(exp)))
+		return -EFAULT;
+	if(exp.flags & ~(O_CLOEXEC | O_ACCMODE))
+		return -EINVAL;
+	if((exp.flags & O_ACCMODE) != O_RDONLY && (exp.flags & O_ACCMODE) != O_RDWR)
+		return -EINVAL;
+	/* a writable mapping needs a writable device file */
+	if((exp.flags & O_ACCMODE) == O_RDWR && !(file->f_mode & FMODE_WRITE))
+		return -EACCES;
+	if(!PAGE_ALIGNED(exp.offset))
+		return -EINVAL;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if(!buf)
+		return -ENOMEM;
+	buf->pcdev_data = pcdev_data;
+	mutex_init(&buf->lock);
+	INIT_LIST_HEAD(&buf->attachments);
+
+	if(mutex_lock_interruptible(&pcdev_data->lock)) {
+		kfree(buf);
+		return -ERESTARTSYS;
+	}
+	/* raw buffer contents only mean something to importers in stream mode */
+	if(pcdev_data->mode != PCD_MODE_STREAM)
+		goto unlock;
+	/* check the range under the lock, a resize can shrink the backing until exports is raised */
+	buf->bk = pcd_bk(pcdev_data);
+	if(exp.offset >= buf->bk->size)
+		goto unlock;
+	if(!exp.len)
+		exp.len = buf->bk->size - exp.offset;
+	if(exp.len > buf->bk->size - exp.offset)
+		goto unlock;
+	buf->first = exp.offset >> PAGE_SHIFT;
+	buf->nr_pages = DIV_ROUND_UP(exp.len, PAGE_SIZE);
+	pcdev_data->exports++;
+	mutex_unlock(&pcdev_data->lock);
+
+	exp_info.ops = &pcd_dmabuf_ops;
+	exp_info.size = (size_t)buf->nr_pages << PAGE_SHIFT;
+	exp_info.flags = exp.flags & O_ACCMODE;
+	exp_info.priv = buf;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if(IS_ERR(dmabuf)) {
+		/* release is not called for a failed export */
+		pcd_dmabuf_free(buf);
+		return PTR_ERR(dmabuf);
+	}
+
+	fd = dma_buf_fd(dmabuf, exp.flags & O_CLOEXEC);
+	if(fd < 0) {
+		dma_buf_put(dmabuf);
+		return fd;
+	}
+
+	/* the fd is installed already, like other exporters a fault here leaves it open */
+	ret = put_user(fd, &uexp->fd);
+	return ret;
+
+unlock:
+	mutex_unlock(&pcdev_data->lock);
+	kfree(buf);
+	return -EINVAL;
+}
+
+/*
+	Take the device lock for a stream write, waiting for dma-buf users to
+	leave their CPU access brackets first.
+*/
+static int pcd_lock_for_write(struct pcdev_private_data* pcdev_data) {
+
+	for(;;) {
+		if(mutex_lock_interruptible(&pcdev_data->lock))
+			return -ERESTARTSYS;
+		if(!pcdev_data->cpu_access)
+			return 0;
+		mutex_unlock(&pcdev_data->lock);
+
+		if(wait_event_interruptible(pcdev_data->wr_wq, !READ_ONCE(pcdev_data->cpu_access)))
+			return -ERESTARTSYS;
+	}
+}
+
+/*
+	Device side operations
+	Fill, zero and move ranges of a stream buffer, or copy between two
+	devices, without the data going through user space. Large ranges are
+	processed in chunks with a preemption point in between, the device
+	lock stays held so other writers never see a half done operation.
+*/
+static bool pcd_range_ok(struct pcdev_private_data* pcdev_data, u64 offset, u64 len) {
+
+	return len && offset <= pcdev_data->size && len <= pcdev_data->size - offset;
+}
+
+/* Write pattern, width bytes wide, over [offset, offset + len). Called with lock held */
+static void pcd_op_fill(struct pcdev_private_data* pcdev_data, unsigned offset, unsigned len, u64 pattern, u32 width) {
+
+	struct pcd_backing* bk = pcd_bk(pcdev_data);
+	unsigned chunk;
+
+	while(len) {
+		chunk = min_t(unsigned, len, PCD_OP_CHUNK);
+		switch(width) {
+			case 1:
+				memset(bk->data + offset, (u8)pattern, chunk);
+				break;
+			case 2:
+				memset16((u16*)(bk->data + offset), pattern, chunk / 2);
+				break;
+			case 4:
+				memset32((u32*)(bk->data + offset), pattern, chunk / 4);
+				break;
+			default:
+				memset64((u64*)(bk->data + offset), pattern, chunk / 8);
+				break;
+		}
+		pcd_backing_sync(bk, offset, chunk);
+		offset += chunk;
+		len -= chunk;
+		cond_resched();
+	}
+}
+
+/*
+	Copy len bytes from src to dst, the ranges may overlap when both are on
+	the same buffer. Chunks are walked backwards when dst is above src so
+	that no chunk overwrites source bytes that are still to be copied.
+*/
+static void pcd_op_move(struct pcd_backing* dbk, unsigned dst, const char* src, unsigned len) {
+
+	unsigned chunk;
+
+	if(dbk->data + dst > src) {
+		while(len) {
+			chunk = min_t(unsigned, len, PCD_OP_CHUNK);
+			len -= chunk;
+			memmove(dbk->data + dst + len, src + len, chunk);
+			pcd_backing_sync(dbk, dst + len, chunk);
+			cond_resched();
+		}
+		return;
+	}
+
+	while(len) {
+		chunk = min_t(unsigned, len, PCD_OP_CHUNK);
+		memmove(dbk->data + dst, src, chunk);
+		pcd_backing_sync(dbk, dst, chunk);
+		dst += chunk;
+		src += chunk;
+		len -= chunk;
+		cond_resched();
+	}
+}
+
+static long pcd_fill(struct file* file, struct pcd_fill __user* ufill) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_fill fill;
+	long ret = 0;
+
+	if(!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(copy_from_user(&fill, ufill, sizeof(fill)))
+		return -EFAULT;
+	if(fill.width != 1 && fill.width != 2 && fill.width != 4 && fill.width != 8)
+		return -EINVAL;
+	if(fill.width < 8 && fill.pattern >> (fill.width * 8))
+		return -EINVAL;
+	/* the wide memset variants store whole, aligned words */
+	if(!IS_ALIGNED(fill.offset | fill.len, fill.width))
+		return -EINVAL;
+
+	if(pcd_lock_for_write(pcdev_data))
+		return -ERESTARTSYS;
+	if(pcdev_data->mode != PCD_MODE_STREAM) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	if(!pcd_range_ok(pcdev_data, fill.offset, fill.len)) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	pcd_op_fill(pcdev_data, fill.offset, fill.len, fill.pattern, fill.width);
+
+unlock:
+	mutex_unlock(&pcdev_data->lock);
+	if(!ret)
+		pcd_doorbell_wake(pcdev_data);
+	return ret;
+}
+
+static long pcd_zero(struct file* file, struct pcd_range __user* urange) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_range range;
+	long ret = 0;
+
+	if(!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(copy_from_user(&range, urange, sizeof(range)))
+		return -EFAULT;
+
+	if(pcd_lock_for_write(pcdev_data))
+		return -ERESTARTSYS;
+	if(pcdev_data->mode != PCD_MODE_STREAM) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	/* len 0 clears everything from offset to the end of the buffer */
+	if(!range.len && range.offset < pcdev_data->size)
+		range.len = pcdev_data->size - range.offset;
+	if(!pcd_range_ok(pcdev_data, range.offset, range.len)) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	pcd_op_fill(pcdev_data, range.offset, range.len, 0, 1);
+
+unlock:
+	mutex_unlock(&pcdev_data->lock);
+	if(!ret)
+		pcd_doorbell_wake(pcdev_data);
+	return ret;
+}
+
+/*
+	Take the locks of a copy. Locks are always taken in minor order so that
+	two copies running in opposite directions can not deadlock. Like
+	pcd_lock_for_write(), waits for dma-buf users of dst to finish.
+*/
+static int pcd_lock_pair(struct pcdev_private_data* dst, struct pcdev_private_data* src) {
+
+	struct pcdev_private_data* first = dst < src ? dst : src;
+	struct pcdev_private_data* second = dst < src ? src : dst;
+
+	for(;;) {
+		if(mutex_lock_interruptible(&first->lock))
+			return -ERESTARTSYS;
+		if(mutex_lock_interruptible_nested(&second->lock, SINGLE_DEPTH_NESTING)) {
+			mutex_unlock(&first->lock);
+			return -ERESTARTSYS;
+		}
+		if(!dst->cpu_access)
+			return 0;
+		mutex_unlock(&second->lock);
+		mutex_unlock(&first->lock);
+
+		if(wait_event_interruptible(dst->wr_wq, !READ_ONCE(dst->cpu_access)))
+			return -ERESTARTSYS;
+	}
+}
+
+static long pcd_move(struct file* file, struct pcd_move __user* umove) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_move move;
+	struct pcd_backing* bk;
+	long ret = 0;
+
+	if(!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(copy_from_user(&move, umove, sizeof(move)))
+		return -EFAULT;
+
+	if(pcd_lock_for_write(pcdev_data))
+		return -ERESTARTSYS;
+	if(pcdev_data->mode != PCD_MODE_STREAM) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	if(!pcd_range_ok(pcdev_data, move.src, move.len) || !pcd_range_ok(pcdev_data, move.dst, move.len)) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	bk = pcd_bk(pcdev_data);
+	pcd_op_move(bk, move.dst, bk->data + move.src, move.len);
+
+unlock:
+	mutex_unlock(&pcdev_data->lock);
+	if(!ret)
+		pcd_doorbell_wake(pcdev_data);
+	return ret;
+}
+
+/* Copy a range of the device open as copy.src_fd into this device */
+static long pcd_copy(struct file* file, struct pcd_copy __user* ucopy) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcdev_private_data* src_data;
+	struct pcd_backing* bk;
+	struct pcd_copy copy;
+	struct fd src;
+	long ret = 0;
+
+	if(!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(copy_from_user(&copy, ucopy, sizeof(copy)))
+		return -EFAULT;
 
-};
+	src = fdget(copy.src_fd);
+	if(!src.file)
+		return -EBADF;
+	/* every pcd file operations table releases through pcd_release */
+	if(src.file->f_op->release != pcd_release) {
+		ret = -EINVAL;
+		goto put;
+	}
+	if(!(src.file->f_mode & FMODE_READ)) {
+		ret = -EBADF;
+		goto put;
+	}
+	src_data = pcd_file_dev(src.file);
 
+	/* within one device this is a move */
+	if(src_data == pcdev_data) {
+		if(pcd_lock_for_write(pcdev_data)) {
+			ret = -ERESTARTSYS;
+			goto put;
+		}
+	} else if(pcd_lock_pair(pcdev_data, src_data)) {
+		ret = -ERESTARTSYS;
+		goto put;
+	}
 
-/* Driver private data */
-struct pcdrv_private_data {
+	if(pcdev_data->mode != PCD_MODE_STREAM || src_data->mode != PCD_MODE_STREAM) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	if(!pcd_range_ok(src_data, copy.src_offset, copy.len) ||
+	   !pcd_range_ok(pcdev_data, copy.dst_offset, copy.len)) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	bk = pcd_bk(src_data);
+	pcd_op_move(pcd_bk(pcdev_data), copy.dst_offset, bk->data + copy.src_offset, copy.len);
 
-	int total_dev;
-	dev_t dev_num;
-	struct class* class_pcd;
-	struct device* device_pcd;
-	struct pcdev_private_data pcdev_data[PCD_MAX_MINORS];
-	
-};
+unlock:
+	if(src_data != pcdev_data)
+		mutex_unlock(&src_data->lock);
+	mutex_unlock(&pcdev_data->lock);
+	if(!ret)
+		pcd_doorbell_wake(pcdev_data);
+put:
+	fdput(src);
+	return ret;
+}
 
-struct pcdrv_private_data pcdrv_data = 
-{	
-	.total_dev = PCD_MAX_MINORS,
-	.pcdev_data = 
-	{
-		[0] = 
-		{
-			.buffer = pcd1_buff,
-			.size  = PCD1_BUFF_SIZE,
-			.serial_number = "PCDEV1",
-			.perm = RDONLY
-				
-		},
-		
-		[1] = 
-		{
-			.buffer = pcd2_buff,
-			.size  = PCD2_BUFF_SIZE,
-			.serial_number = "PCDEV2",
-			.perm = RDWR
-				
-		},
-		
-		[2] = 
-		{
-			.buffer = pcd3_buff,
-			.size  = PCD3_BUFF_SIZE,
-			.serial_number = "PCDEV3",
-			.perm = WRONLY
-				
-		},
-		
-		[3] = 
-		{
-			.buffer = pcd4_buff,
-			.size  = PCD4_BUFF_SIZE,
-			.serial_number = "PCDEV4",  
-			.perm = RDWR
-				
+/*
+	Doorbell
+	Lets processes sharing a device sleep until a word of the buffer changes
+	instead of spinning on it, the futex wait/wake pair for pcd.
+*/
+static u64 pcd_doorbell_word(struct pcdev_private_data* pcdev_data, u64 offset, u32 width) {
+
+	struct pcd_backing* bk;
+	u64 val = 0;
+
+	rcu_read_lock();
+	bk = rcu_dereference(pcdev_data->bk);
+	/* the buffer may have shrunk since the offset was checked */
+	if(!bk || width > bk->size || offset > bk->size - width)
+		val = 0;
+	else if(width == sizeof(u32))
+		val = READ_ONCE(*(u32*)(bk->data + offset));
+	else
+		val = READ_ONCE(*(u64*)(bk->data + offset));
+	rcu_read_unlock();
+
+	return val;
+}
+
+static bool pcd_doorbell_rung(struct pcdev_private_data* pcdev_data, const struct pcd_wait_word* ww) {
+
+	return pcd_doorbell_word(pcdev_data, ww->offset, ww->width) != ww->expected;
+}
+
+static void pcd_doorbell_wake(struct pcdev_private_data* pcdev_data) {
+
+	/* wq_has_sleeper() orders the buffer update against the waiter's check */
+	if(wq_has_sleeper(&pcdev_data->db_wq))
+		wake_up_interruptible_all(&pcdev_data->db_wq);
+}
+
+static long pcd_doorbell_wait(struct file* file, struct pcd_wait_word __user* uwait) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_wait_word ww;
+	long ret;
+
+	if(copy_from_user(&ww, uwait, sizeof(ww)))
+		return -EFAULT;
+	if(ww.width != sizeof(u32) && ww.width != sizeof(u64))
+		return -EINVAL;
+	if(ww.width == sizeof(u32) && ww.expected > U32_MAX)
+		return -EINVAL;
+	/* written so that a huge offset can not wrap around the end of the buffer */
+	if(!IS_ALIGNED(ww.offset, ww.width) || ww.width > pcdev_data->size ||
+	   ww.offset > pcdev_data->size - ww.width)
+		return -EINVAL;
+	/* in record mode the buffer holds the ring, not addressable words */
+	if(pcdev_data->mode != PCD_MODE_STREAM)
+		return -EINVAL;
+
+	if(pcd_doorbell_rung(pcdev_data, &ww))
+		return -EAGAIN;
+
+	if(!ww.timeout_ns)
+		return wait_event_interruptible(pcdev_data->db_wq, pcd_doorbell_rung(pcdev_data, &ww));
+
+	ret = wait_event_interruptible_hrtimeout(pcdev_data->db_wq, pcd_doorbell_rung(pcdev_data, &ww),
+						 ns_to_ktime(ww.timeout_ns));
+
+	return ret == -ETIME ? -ETIMEDOUT : ret;
+}
+
+static long pcd_set_busy_poll(struct file* file, struct pcd_busy_poll __user* ubp) {
+
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+	struct pcd_busy_poll bp;
+
+	if(copy_from_user(&bp, ubp, sizeof(bp)))
+		return -EFAULT;
+	if(bp.flags & ~(PCD_BUSY_POLL_DEVICE | PCD_BUSY_POLL_ADAPTIVE | PCD_BUSY_POLL_INHERIT))
+		return -EINVAL;
+	/* spinning for longer than a millisecond never beats a wakeup */
+	if(bp.usecs > USEC_PER_MSEC)
+		return -EINVAL;
+	/* the device default applies to every other reader */
+	if((bp.flags & PCD_BUSY_POLL_DEVICE) && !(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	if(bp.flags & PCD_BUSY_POLL_DEVICE) {
+		WRITE_ONCE(pcdev_data->busy_poll_us, bp.usecs);
+		WRITE_ONCE(pcdev_data->busy_poll_adaptive, !!(bp.flags & PCD_BUSY_POLL_ADAPTIVE));
+	} else if(bp.flags & PCD_BUSY_POLL_INHERIT) {
+		fdata->busy_poll_set = false;
+	} else {
+		fdata->busy_poll_us = bp.usecs;
+		fdata->busy_poll_adaptive = !!(bp.flags & PCD_BUSY_POLL_ADAPTIVE);
+		fdata->busy_poll_set = true;
+	}
+	return 0;
+}
+
+/* Report the busy poll setting in effect for this open file */
+static long pcd_get_busy_poll(struct file* file, struct pcd_busy_poll __user* ubp) {
+
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+	struct pcd_busy_poll bp = {
+		.usecs = pcdev_data->busy_poll_us,
+		.flags = PCD_BUSY_POLL_INHERIT | (pcdev_data->busy_poll_adaptive ? PCD_BUSY_POLL_ADAPTIVE : 0)
+	};
+
+	if(fdata->busy_poll_set) {
+		bp.usecs = fdata->busy_poll_us;
+		bp.flags = fdata->busy_poll_adaptive ? PCD_BUSY_POLL_ADAPTIVE : 0;
+	}
+	return copy_to_user(ubp, &bp, sizeof(bp)) ? -EFAULT : 0;
+}
+
+static long pcd_get_stats(struct file* file, struct pcd_stats __user* ustats) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_stats stats = {
+		.busy_poll_attempts = atomic64_read(&pcdev_data->busy_poll_attempts),
+		.busy_poll_hits = atomic64_read(&pcdev_data->busy_poll_hits),
+		.busy_poll_misses = atomic64_read(&pcdev_data->busy_poll_misses),
+		.busy_poll_skipped = atomic64_read(&pcdev_data->busy_poll_skipped),
+		.busy_poll_ns = atomic64_read(&pcdev_data->busy_poll_ns),
+		.arrival_gap_ns = READ_ONCE(pcdev_data->arrival_gap_ns),
+		.wakeups = atomic64_read(&pcdev_data->wakeups),
+		.wakeups_coalesced = atomic64_read(&pcdev_data->wakeups_coalesced),
+		.wakeups_timer = atomic64_read(&pcdev_data->wakeups_timer),
+		.mem_charged = atomic_long_read(&pcdev_data->charged),
+		.mem_reclaimed = atomic64_read(&pcdev_data->reclaimed)
+	};
+
+	return copy_to_user(ustats, &stats, sizeof(stats)) ? -EFAULT : 0;
+}
+
+static long pcd_set_watermark(struct file* file, struct pcd_watermark __user* uwm) {
+
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+	struct pcd_watermark wm;
+	long ret = 0;
+
+	if(copy_from_user(&wm, uwm, sizeof(wm)))
+		return -EFAULT;
+	if(wm.flags & ~(PCD_WM_DEVICE | PCD_WM_INHERIT))
+		return -EINVAL;
+	/* the device default applies to every other reader */
+	if((wm.flags & PCD_WM_DEVICE) && !(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	if(mutex_lock_interruptible(&pcdev_data->lock))
+		return -ERESTARTSYS;
+	if(wm.flags & PCD_WM_DEVICE) {
+		ret = pcd_wm_apply(pcdev_data, &pcdev_data->wm, &wm);
+	} else if(wm.flags & PCD_WM_INHERIT) {
+		fdata->wm_set = false;
+		pcd_wm_recalc(pcdev_data);
+	} else {
+		ret = pcd_wm_apply(pcdev_data, &fdata->wm, &wm);
+		if(!ret) {
+			fdata->wm_set = true;
+			pcd_wm_recalc(pcdev_data);
 		}
 	}
+	mutex_unlock(&pcdev_data->lock);
 
-};
+	/* a looser watermark may make queued messages readable */
+	wake_up_interruptible(&pcdev_data->rd_wq);
+	return ret;
+}
 
-static int pcd_open(struct inode* inode, struct file* file);
-static int pcd_release(struct inode* inode, struct file* file);
-static ssize_t pcd_read (struct file * file, char __user * buff, size_t size, loff_t * offset);
-static ssize_t pcd_write(struct file * file, const char __user * buff, size_t size, loff_t * offset);
-static loff_t pcd_llseek(struct file* file, loff_t off, int whence);
+static long pcd_get_watermark(struct file* file, struct pcd_watermark __user* uwm) {
 
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+	struct pcd_watermark wm;
 
-/* File operations for pcd */
-struct file_operations pcd_fops = {
-	.owner = THIS_MODULE,
-	.open  = pcd_open,
-	.release = pcd_release,
-	.read  = pcd_read,
-	.write = pcd_write,
-	.llseek = pcd_llseek
-};
+	mutex_lock(&pcdev_data->lock);
+	wm = *pcd_file_wm(fdata);
+	if(!fdata->wm_set)
+		wm.flags = PCD_WM_INHERIT;
+	mutex_unlock(&pcdev_data->lock);
 
-int check_permission(int dev_perm, int acc_mode){
+	return copy_to_user(uwm, &wm, sizeof(wm)) ? -EFAULT : 0;
+}
 
-	if(dev_perm == RDWR) {
-		return 0;
+static long pcd_set_numa(struct file* file, struct pcd_numa __user* unuma) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_numa numa;
+	bool replicate;
+	long ret;
+	int nid;
+
+	/* placement and replicas are charged to the device like a resize */
+	if(!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(copy_from_user(&numa, unuma, sizeof(numa)))
+		return -EFAULT;
+	if(numa.flags & ~PCD_NUMA_REPLICATE)
+		return -EINVAL;
+	if(numa.node != NUMA_NO_NODE && (numa.node < 0 || numa.node >= nr_node_ids || !node_online(numa.node)))
+		return -EINVAL;
+	replicate = numa.flags & PCD_NUMA_REPLICATE;
+
+	if(mutex_lock_interruptible(&pcdev_data->lock))
+		return -ERESTARTSYS;
+
+	nid = numa.node == NUMA_NO_NODE ? pcd_bk(pcdev_data)->node : numa.node;
+	if(replicate && pcdev_data->mode != PCD_MODE_STREAM) {
+		ret = -EINVAL;
+		goto unlock;
 	}
-	/* Check read only access */
-	if(dev_perm == RDONLY && (acc_mode & FMODE_READ) && !(acc_mode & FMODE_WRITE)) {
-		return 0;
+	/* the key-value arena and dma-buf exports are built over the current buffer */
+	if(pcdev_data->mode == PCD_MODE_KV || pcdev_data->exports) {
+		ret = -EBUSY;
+		goto unlock;
 	}
-	/* Check write only access */
-	if(dev_perm == WRONLY && (acc_mode & FMODE_WRITE) && !(acc_mode & FMODE_READ)) {
-		return 0;
+	if(nid == pcd_bk(pcdev_data)->node && replicate == pcdev_data->replicate) {
+		ret = 0;
+		goto unlock;
 	}
-	
-	/* Check read write access */
-	if(dev_perm == RDWR && (acc_mode & FMODE_WRITE) && (acc_mode & FMODE_READ)) {
-		return 0;
+
+	ret = pcd_backing_migrate(pcdev_data, nid, replicate);
+	if(!ret) {
+		pcdev_data->node = nid;
+		pcdev_data->replicate = replicate;
+		MOD_LOGI("%s buffer moved to node %d, replicas %s", pcdev_data->serial_number,
+			 nid, replicate ? "on" : "off");
 	}
-	
-	return -EPERM;
+
+unlock:
+	mutex_unlock(&pcdev_data->lock);
+	return ret;
 }
-static int pcd_open(struct inode* inode, struct file* file) {
 
-	MOD_LOGI("open");
-	int ret;
-	/* get information about the minor that was opened */
-	int minor = MINOR(inode->i_rdev);
-	MOD_LOGI("minor accessed %d",minor);
-	/* 
-		container_of macro returns pointer to the structure containing member 
-		container_of(ptr,type,member)
-	*/
-	struct pcdev_private_data* pcdev_data = container_of(inode->i_cdev,struct pcdev_private_data,cdev);
-	
-	/* Supply device private data to other methods of driver */
-	file->private_data = pcdev_data;
-	
-	/* check permissions */
-	ret = check_permission(pcdev_data->perm,file->f_mode);
-	
-	if(!ret)MOD_LOGI("open was successfull");
-	else MOD_LOGE("open was unsuccessfull");
-	
+static long pcd_get_numa(struct file* file, struct pcd_numa __user* unuma) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	struct pcd_numa numa;
+
+	mutex_lock(&pcdev_data->lock);
+	numa.node = pcd_bk(pcdev_data)->node;
+	numa.flags = pcdev_data->replicate ? PCD_NUMA_REPLICATE : 0;
+	mutex_unlock(&pcdev_data->lock);
+
+	return copy_to_user(unuma, &numa, sizeof(numa)) ? -EFAULT : 0;
+}
+
+static long pcd_resize(struct file* file, u64 __user* usize) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	u64 size;
+	long ret;
+
+	if(!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(get_user(size, usize))
+		return -EFAULT;
+	if(!size || size > INT_MAX)
+		return -EINVAL;
+
+	if(mutex_lock_interruptible(&pcdev_data->lock))
+		return -ERESTARTSYS;
+	ret = pcd_backing_resize(pcdev_data, size);
+	mutex_unlock(&pcdev_data->lock);
+
 	return ret;
 }
 
-static int pcd_release(struct inode* inode, struct file* file) {
+/* Attach the BPF program prog_fd as the read filter of this file, -1 detaches it */
+static long pcd_set_filter(struct file* file, s32 __user* ufd) {
 
-	MOD_LOGI("release");
-	return 0;
+	struct pcd_file_data* fdata = file->private_data;
+	struct pcdev_private_data* pcdev_data = fdata->pcdev_data;
+	struct bpf_prog* prog = NULL;
+	struct bpf_prog* old;
+	long ret = 0;
+	s32 fd;
+
+	if(!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if(get_user(fd, ufd))
+		return -EFAULT;
+	if(fd >= 0) {
+		prog = bpf_prog_get_type(fd, BPF_PROG_TYPE_SOCKET_FILTER);
+		if(IS_ERR(prog))
+			return PTR_ERR(prog);
+	} else if(fd != -1) {
+		return -EBADF;
+	}
+
+	if(mutex_lock_interruptible(&pcdev_data->lock)) {
+		ret = -ERESTARTSYS;
+		goto put;
+	}
+	/* only messages and log records have boundaries to filter on */
+	if(prog && pcdev_data->mode != PCD_MODE_RECORD && pcdev_data->mode != PCD_MODE_LOG) {
+		mutex_unlock(&pcdev_data->lock);
+		ret = -EINVAL;
+		goto put;
+	}
+	old = rcu_replace_pointer(fdata->filter, prog, lockdep_is_held(&pcdev_data->lock));
+	mutex_unlock(&pcdev_data->lock);
+
+	/* lockless log readers hold their own reference */
+	prog = old;
+put:
+	if(prog)
+		bpf_prog_put(prog);
+	return ret;
+}
+
+static long pcd_ioctl(struct file* file, unsigned int cmd, unsigned long arg) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	void __user* uarg = (void __user*)arg;
+	u32 mode;
+
+	switch(cmd) {
+
+		case PCD_IOC_SET_MODE:
+			if(get_user(mode, (u32 __user*)uarg))
+				return -EFAULT;
+			return pcd_set_mode(file, mode);
+		case PCD_IOC_GET_MODE:
+			return put_user((u32)pcdev_data->mode, (u32 __user*)uarg);
+		case PCD_IOC_RECV_BATCH:
+			return pcd_record_recv_batch(file, uarg);
+		case PCD_IOC_WAIT_WORD:
+			return pcd_doorbell_wait(file, uarg);
+		case PCD_IOC_WAKE:
+			pcd_doorbell_wake(pcdev_data);
+			return 0;
+		case PCD_IOC_SET_BUSY_POLL:
+			return pcd_set_busy_poll(file, uarg);
+		case PCD_IOC_GET_BUSY_POLL:
+			return pcd_get_busy_poll(file, uarg);
+		case PCD_IOC_GET_STATS:
+			return pcd_get_stats(file, uarg);
+		case PCD_IOC_SET_WATERMARK:
+			return pcd_set_watermark(file, uarg);
+		case PCD_IOC_GET_WATERMARK:
+			return pcd_get_watermark(file, uarg);
+		case PCD_IOC_SET_NUMA:
+			return pcd_set_numa(file, uarg);
+		case PCD_IOC_GET_NUMA:
+			return pcd_get_numa(file, uarg);
+		case PCD_IOC_KV_GET:
+			return pcd_kv_get(file, uarg);
+		case PCD_IOC_KV_PUT:
+			return pcd_kv_put(file, uarg);
+		case PCD_IOC_KV_DEL:
+			return pcd_kv_del(file, uarg);
+		case PCD_IOC_KV_MGET:
+			return pcd_kv_mget(file, uarg);
+		case PCD_IOC_KV_ITER:
+			return pcd_kv_iter(file, uarg);
+		case PCD_IOC_EXPORT_DMABUF:
+			return pcd_export_dmabuf(file, uarg);
+		case PCD_IOC_RESIZE:
+			return pcd_resize(file, uarg);
+		case PCD_IOC_FILL:
+			return pcd_fill(file, uarg);
+		case PCD_IOC_ZERO:
+			return pcd_zero(file, uarg);
+		case PCD_IOC_MOVE:
+			return pcd_move(file, uarg);
+		case PCD_IOC_COPY:
+			return pcd_copy(file, uarg);
+		case PCD_IOC_LOG_SEEK:
+			return pcd_log_seek(file, uarg);
+		case PCD_IOC_SET_FILTER:
+			return pcd_set_filter(file, uarg);
+		default:
+			return -ENOTTY;
+	}
+}
+
+/* only the record ring has to wait for data or space */
+static __poll_t pcd_stream_poll(struct file* file, struct poll_table_struct* wait) {
+
+	return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+}
+
+static __poll_t pcd_record_poll(struct file* file, struct poll_table_struct* wait) {
+
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	__poll_t mask = 0;
+
+	poll_wait(file, &pcdev_data->rd_wq, wait);
+	poll_wait(file, &pcdev_data->wr_wq, wait);
+
+	if(pcd_record_ready(pcdev_data, pcd_file_wm(file->private_data)))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if(pcdev_data->size - READ_ONCE(pcdev_data->used) > PCD_REC_HDR_SIZE)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+
+/* keys and values are only reachable through the PCD_IOC_KV_* ioctls */
+static ssize_t pcd_kv_read(struct file* file, char __user* buff, size_t size, loff_t* offset) {
+
+	return -EOPNOTSUPP;
+}
+
+static ssize_t pcd_kv_write(struct file* file, const char __user* buff, size_t size, loff_t* offset) {
+
+	return -EOPNOTSUPP;
 }
 
+static inline size_t pcd_copy_chunk(void) {
 
-static ssize_t pcd_read(struct file * file, char __user * buff, size_t size, loff_t * offset) {
+	return READ_ONCE(copy_chunk) ?: PAGE_SIZE;
+}
+
+static ssize_t pcd_stream_read(struct file * file, char __user * buff, size_t size, loff_t * offset) {
 
 
-	MOD_LOGI("read req %zu bytes",size);
-	MOD_LOGI("Current file position %lld\n",*offset);
+	MOD_LOGD("read req %zu bytes",size);
+	MOD_LOGD("Current file position %lld\n",*offset);
 	
 	/* get device's private data */
-	struct pcdev_private_data* pcdev_data = (struct pcdev_private_data*)file->private_data;
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	size_t max_chunk = pcd_copy_chunk();
+	size_t done = 0, chunk;
+	unsigned long left;
+	const char* data;
 	
-	/* Adjust the amount of data to be read */
-	if(size > pcdev_data->size - *offset) size = pcdev_data->size - *offset;
+	/* reference the buffer, a concurrent resize does not block us */
+	struct pcd_backing* bk = pcd_backing_get(pcdev_data);
 	
 	/* Check if offset has reached end of file */
-	if(size <= 0) return 0;
+	if(*offset >= bk->size) {
+		pcd_backing_put(bk);
+		return 0;
+	}
 	
-	/* Copy data to user space buffer */
-	if(copy_to_user(buff,pcdev_data->buffer + *offset,size)) {
-		return -EFAULT;
+	/* Adjust the amount of data to be read */
+	if(size > bk->size - *offset) size = bk->size - *offset;
+	
+	/* Copy data to user space buffer, from the copy local to this node, a chunk at a time */
+	data = pcd_backing_local(bk) + *offset;
+	while(done < size) {
+		chunk = min(size - done, max_chunk);
+		left = copy_to_user(buff + done, data + done, chunk);
+		done += chunk - left;
+		if(left)
+			break;
+		if(done < size)
+			cond_resched();
 	}
+	pcd_backing_put(bk);
+	
+	/* a fault after some progress returns what was copied, like a short read */
+	if(!done)
+		return -EFAULT;
 	
 	/* Update the offset pointer */
-	*offset += size;
+	*offset += done;
 	
-	MOD_LOGI("# of bytes successfully read %d",size);
-	MOD_LOGI("Updated file position %lld\n",*offset);
+	MOD_LOGD("# of bytes successfully read %zu",done);
+	MOD_LOGD("Updated file position %lld\n",*offset);
 	
 	/* return number of bytes successfully read */
-	return size;
+	return done;
 
 }
 
-static ssize_t pcd_write(struct file * file, const char __user * buff, size_t size, loff_t * offset) {
+/*
+	Writes are copied a chunk at a time with the lock dropped in between, so
+	a large write lets other readers and writers of the device run. Only the
+	chunks, not the whole write, are atomic with respect to other writers.
+*/
+static ssize_t pcd_stream_write(struct file * file, const char __user * buff, size_t size, loff_t * offset) {
 
 
-	MOD_LOGI("write req %zu bytes",size);
-	MOD_LOGI("Current file position %lld\n",*offset);
+	MOD_LOGD("write req %zu bytes",size);
+	MOD_LOGD("Current file position %lld\n",*offset);
 	
 	/* get device's private data */
-	struct pcdev_private_data* pcdev_data = (struct pcdev_private_data*)file->private_data;
-	
-	/* Adjust the amount of data to be read */
-	if(size > pcdev_data->size - *offset) size = pcdev_data->size - *offset;
+	struct pcdev_private_data* pcdev_data = pcd_file_dev(file);
+	size_t max_chunk = pcd_copy_chunk();
+	size_t done = 0, chunk;
+	loff_t pos = *offset;
+	unsigned long left;
+	ssize_t ret = 0;
 	
-	/* if pcd_buff is full no more data can be written */
-	if(size <= 0) {
-		MOD_LOGI("No more memory to write data\n",);
-		return -ENOMEM;
-	}
-	/* Copy data from user space buffer to kernel using kernel data copy utility (copy_from_user()) */
-	if(copy_from_user(pcdev_data->buffer + *offset,buff,size)) {
-		return -EFAULT;
+	while(done < size) {
+		/* writers are serialized so that the replicas end up identical */
+		if(pcd_lock_for_write(pcdev_data)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		
+		/* another thread sharing this file switched the mode while we waited */
+		if(pcdev_data->mode != PCD_MODE_STREAM) {
+			mutex_unlock(&pcdev_data->lock);
+			ret = -EINVAL;
+			break;
+		}
+		
+		/* if pcd_buff is full no more data can be written */
+		if(pos >= pcdev_data->size) {
+			mutex_unlock(&pcdev_data->lock);
+			if(!done)
+				MOD_LOGD("No more memory to write data\n",);
+			ret = -ENOMEM;
+			break;
+		}
+		
+		/* Adjust the amount of data to be written, the size is stable under lock */
+		chunk = min3(size - done, (size_t)(pcdev_data->size - pos), max_chunk);
+		
+		/* Copy data from user space buffer to kernel using kernel data copy utility (copy_from_user()) */
+		left = copy_from_user(pcd_bk(pcdev_data)->data + pos,buff + done,chunk);
+		pcd_backing_sync(pcd_bk(pcdev_data),pos,chunk - left);
+		mutex_unlock(&pcdev_data->lock);
+		
+		done += chunk - left;
+		pos += chunk - left;
+		if(left) {
+			ret = -EFAULT;
+			break;
+		}
+		cond_resched();
 	}
 	
+	/* report partial progress, the error is only returned if nothing was written */
+	if(!done)
+		return ret;
+	
 	/* Update the offset pointer */
-	*offset += size;
+	*offset = pos;
+	
+	/* ring the doorbell for waiters on the updated words */
+	pcd_doorbell_wake(pcdev_data);
 	
-	MOD_LOGI("# of bytes successfully written %d",size);
-	MOD_LOGI("Updated file position %lld\n",*offset);
+	MOD_LOGD("# of bytes successfully written %zu",done);
+	MOD_LOGD("Updated file position %lld\n",*offset);
 	
 	/* return number of bytes successfully written */
-	return size;
+	return done;
 
 }
 
 static loff_t pcd_llseek(struct file* file, loff_t off, int whence) {
 
 
-	MOD_LOGI("lseek requested");
-	MOD_LOGI("Current file position %lld\n",file->f_pos);
+	MOD_LOGD("lseek requested");
+	MOD_LOGD("Current file position %lld\n",file->f_pos);
 	
-	struct pcdev_private_data* pdev_data = file->private_data;
-	int size  = pdev_data->size;
+	struct pcdev_private_data* pdev_data = pcd_file_dev(file);
+	int size  = READ_ONCE(pdev_data->size);
 	
 	switch(whence) {
 	
@@ -257,18 +3135,195 @@ static loff_t pcd_llseek(struct file* file, loff_t off, int whence) {
 		
 	}
 	
-	MOD_LOGI("Updated file position %lld\n",file->f_pos);
+	MOD_LOGD("Updated file position %lld\n",file->f_pos);
 	return file->f_pos;
 }
 
+/*
+	Shrinker
+	Under memory pressure the buffers of idle devices are given back when
+	they hold nothing worth keeping : an all zero stream buffer or an empty
+	record ring. A device is idle when nobody has it open or exported, and
+	its buffer is allocated again, zeroed, by the next open.
+*/
+static bool pcd_reclaimable(struct pcdev_private_data* pcdev_data) {
+
+	return list_empty(&pcdev_data->files) && !pcdev_data->exports &&
+	       pcdev_data->mode != PCD_MODE_KV && rcu_access_pointer(pcdev_data->bk);
+}
+
+static unsigned long pcd_shrink_count(struct shrinker* shrink, struct shrink_control* sc) {
+
+	unsigned long count = 0;
+	int i;
+
+	/* a racy estimate is fine here, scan checks again under the lock */
+	for(i = 0; i < PCD_MAX_MINORS; i++)
+		if(pcd_reclaimable(&pcdrv_data.pcdev_data[i]))
+			count += atomic_long_read(&pcdrv_data.pcdev_data[i].charged) >> PAGE_SHIFT;
+
+	return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long pcd_shrink_scan(struct shrinker* shrink, struct shrink_control* sc) {
+
+	struct pcdev_private_data* pcdev_data;
+	struct pcd_backing* bk;
+	unsigned long freed = 0;
+	bool clean;
+	int i;
+
+	for(i = 0; i < PCD_MAX_MINORS && freed < sc->nr_to_scan; i++) {
+		pcdev_data = &pcdrv_data.pcdev_data[i];
+
+		/* never wait on a device from reclaim */
+		if(!mutex_trylock(&pcdev_data->lock))
+			continue;
+		if(!pcd_reclaimable(pcdev_data))
+			goto next;
+
+		bk = pcd_bk(pcdev_data);
+		if(pcdev_data->mode == PCD_MODE_RECORD)
+			clean = !pcdev_data->nr_records;
+		else if(pcdev_data->mode == PCD_MODE_LOG)
+			clean = !pcdev_data->log_tail;
+		else
+			clean = !memchr_inv(bk->data, 0, pcdev_data->size);
+		if(!clean)
+			goto next;
+
+		RCU_INIT_POINTER(pcdev_data->bk, NULL);
+		pcd_ring_reset(pcdev_data);
+		freed += bk->charged >> PAGE_SHIFT;
+		atomic64_add(bk->charged, &pcdev_data->reclaimed);
+		/* freed after a grace period, the doorbell may still look at it */
+		pcd_backing_put(bk);
+next:
+		mutex_unlock(&pcdev_data->lock);
+	}
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker pcd_shrinker = {
+	.count_objects = pcd_shrink_count,
+	.scan_objects = pcd_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/*
+	sysfs attributes of the device, under /sys/class/pcd_class/pcd-N/
+	The device wide wakeup watermarks can be tuned here as well as through
+	PCD_IOC_SET_WATERMARK.
+*/
+#define PCD_WM_ATTR(field)									\
+static ssize_t field##_show(struct device* dev, struct device_attribute* attr, char* buf) {	\
+												\
+	struct pcdev_private_data* pcdev_data = dev_get_drvdata(dev);				\
+												\
+	return sysfs_emit(buf, "%u\n", READ_ONCE(pcdev_data->wm.field));			\
+}												\
+												\
+static ssize_t field##_store(struct device* dev, struct device_attribute* attr,		\
+			     const char* buf, size_t count) {					\
+												\
+	struct pcdev_private_data* pcdev_data = dev_get_drvdata(dev);				\
+	struct pcd_watermark wm;								\
+	u32 val;										\
+	int ret;										\
+												\
+	ret = kstrtou32(buf, 0, &val);								\
+	if(ret)											\
+		return ret;									\
+												\
+	mutex_lock(&pcdev_data->lock);								\
+	wm = pcdev_data->wm;									\
+	wm.field = val;										\
+	ret = pcd_wm_apply(pcdev_data, &pcdev_data->wm, &wm);					\
+	mutex_unlock(&pcdev_data->lock);							\
+												\
+	wake_up_interruptible(&pcdev_data->rd_wq);						\
+	return ret ? ret : count;								\
+}												\
+static DEVICE_ATTR_RW(field)
+
+PCD_WM_ATTR(lowat_bytes);
+PCD_WM_ATTR(lowat_records);
+PCD_WM_ATTR(hiwat_bytes);
+PCD_WM_ATTR(max_latency_us);
+
+/* Buffer size in bytes, writing it resizes the buffer like PCD_IOC_RESIZE */
+static ssize_t size_show(struct device* dev, struct device_attribute* attr, char* buf) {
+
+	struct pcdev_private_data* pcdev_data = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(pcdev_data->size));
+}
+
+static ssize_t size_store(struct device* dev, struct device_attribute* attr,
+			  const char* buf, size_t count) {
+
+	struct pcdev_private_data* pcdev_data = dev_get_drvdata(dev);
+	u32 val;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &val);
+	if(ret)
+		return ret;
+	if(!val || val > INT_MAX)
+		return -EINVAL;
+
+	mutex_lock(&pcdev_data->lock);
+	ret = pcd_backing_resize(pcdev_data, val);
+	mutex_unlock(&pcdev_data->lock);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(size);
+
+static struct attribute* pcd_dev_attrs[] = {
+	&dev_attr_size.attr,
+	&dev_attr_lowat_bytes.attr,
+	&dev_attr_lowat_records.attr,
+	&dev_attr_hiwat_bytes.attr,
+	&dev_attr_max_latency_us.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(pcd_dev);
+
 static int __init pcd_init(void) {
 	
 	int ret,i;
+	struct pcd_backing* bk;
+	
+	/* entries are charged to the memcg of the process storing them */
+	pcd_kv_cache = KMEM_CACHE(pcd_kv_entry,SLAB_ACCOUNT);
+	if(!pcd_kv_cache) {
+		MOD_LOGE("kv cache creation failed");
+		return -ENOMEM;
+	}
+	
+	/* Allocate device buffers on their configured node, unless deferred to first use */
+	for(i=0;i<PCD_MAX_MINORS;i++) {
+	
+		pcdrv_data.pcdev_data[i].node = pcd_node[i];
+		if(first_use)
+			continue;
+		
+		bk = pcd_backing_alloc(&pcdrv_data.pcdev_data[i],pcdrv_data.pcdev_data[i].size,pcd_node[i],false);
+		if(IS_ERR(bk)) {
+			MOD_LOGE("buffer allocation failed");
+			ret = PTR_ERR(bk);
+			goto free_backing;
+		}
+		RCU_INIT_POINTER(pcdrv_data.pcdev_data[i].bk,bk);
+	}
+	
 	/* Allocate device number dynamically */
 	ret = alloc_chrdev_region(&pcdrv_data.dev_num,PCD_MINOR_START,PCD_MAX_MINORS,DEV_NAME);
 	if(ret < 0) {
 		MOD_LOGE("alloc_chrdev_region failed");
-		goto out;
+		goto free_backing;
 	}
 	
 	pcdrv_data.class_pcd = class_create(THIS_MODULE,"pcd_class");
@@ -283,6 +3338,15 @@ static int __init pcd_init(void) {
 	
 		MOD_LOGI("Major : %d | Minor : %d\n",MAJOR(pcdrv_data.dev_num + i),MINOR(pcdrv_data.dev_num + i));
 	 
+		mutex_init(&pcdrv_data.pcdev_data[i].lock);
+		init_waitqueue_head(&pcdrv_data.pcdev_data[i].rd_wq);
+		init_waitqueue_head(&pcdrv_data.pcdev_data[i].wr_wq);
+		init_waitqueue_head(&pcdrv_data.pcdev_data[i].db_wq);
+		INIT_LIST_HEAD(&pcdrv_data.pcdev_data[i].files);
+		pcdrv_data.pcdev_data[i].wm_eff = pcdrv_data.pcdev_data[i].wm;
+		hrtimer_init(&pcdrv_data.pcdev_data[i].wm_timer,CLOCK_MONOTONIC,HRTIMER_MODE_REL);
+		pcdrv_data.pcdev_data[i].wm_timer.function = pcd_wm_timer_fn;
+
 		/* Initialize cdev structure */
 		cdev_init(&pcdrv_data.pcdev_data[i].cdev,&pcd_fops);
 		pcdrv_data.pcdev_data[i].cdev.owner = THIS_MODULE;
@@ -295,7 +3359,8 @@ static int __init pcd_init(void) {
 		}
 		
 		/* create device file under /sys/class/pcd_class */
-		pcdrv_data.device_pcd = device_create(pcdrv_data.class_pcd,NULL,pcdrv_data.dev_num + i,NULL,DEV_NAME "-%d",i);
+		pcdrv_data.device_pcd = device_create_with_groups(pcdrv_data.class_pcd,NULL,pcdrv_data.dev_num + i,
+								  &pcdrv_data.pcdev_data[i],pcd_dev_groups,DEV_NAME "-%d",i);
 		if(IS_ERR(pcdrv_data.device_pcd)) {
 			MOD_LOGE("Device creation failed");
 			ret = PTR_ERR(pcdrv_data.device_pcd);
@@ -303,6 +3368,10 @@ static int __init pcd_init(void) {
 		}
 	}
 	
+	/* failing to register only costs automatic reclaim */
+	if(register_shrinker(&pcd_shrinker,"pcd"))
+		MOD_LOGE("shrinker registration failed");
+	
 	MOD_LOGI("module init successfull");
 	return 0;
 
@@ -318,7 +3387,10 @@ delete_class :
 	class_destroy(pcdrv_data.class_pcd);
 unreg_chr_dev:
 	unregister_chrdev_region(pcdrv_data.dev_num,PCD_MAX_MINORS);
-out:
+free_backing:
+	for(i=0;i<PCD_MAX_MINORS;i++)
+		pcd_backing_free(rcu_dereference_protected(pcdrv_data.pcdev_data[i].bk,1));
+	kmem_cache_destroy(pcd_kv_cache);
 	MOD_LOGE("Module insertion failed");
 	return ret;
 
@@ -326,16 +3398,28 @@ out:
 
 static void __exit pcd_exit(void) {
 
+	unregister_shrinker(&pcd_shrinker);
+
 	/* remove the device and device class from sysfs */
 	for(int i=0;i<PCD_MAX_MINORS;i++)
 	{
 		device_destroy(pcdrv_data.class_pcd,pcdrv_data.dev_num+i);
 		cdev_del(&pcdrv_data.pcdev_data[i].cdev);
+		hrtimer_cancel(&pcdrv_data.pcdev_data[i].wm_timer);
+		mutex_lock(&pcdrv_data.pcdev_data[i].lock);
+		pcd_kv_destroy(&pcdrv_data.pcdev_data[i]);
+		pcd_log_destroy(&pcdrv_data.pcdev_data[i]);
+		mutex_unlock(&pcdrv_data.pcdev_data[i].lock);
+		pcd_backing_free(rcu_dereference_protected(pcdrv_data.pcdev_data[i].bk,1));
 
 	}
 	class_destroy(pcdrv_data.class_pcd);
 
 	unregister_chrdev_region(pcdrv_data.dev_num,PCD_MAX_MINORS);
+	
+	/* key-value entries are freed after a grace period */
+	rcu_barrier();
+	kmem_cache_destroy(pcd_kv_cache);
 	MOD_LOGI("module exit");
 }
 
@@ -346,3 +3430,4 @@ module_exit(pcd_exit);
 MODULE_AUTHOR("Parth Panchal");
 MODULE_DESCRIPTION("Pseudo character driver which handles n nodes");
 MODULE_LICENSE("Dual MIT/GPL");
+MODULE_IMPORT_NS(DMA_BUF);
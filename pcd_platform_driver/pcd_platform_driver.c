@@ -7,6 +7,11 @@
 #include<linux/uaccess.h>
 #include<linux/slab.h>
 #include<linux/mod_devicetable.h>
+#include<linux/spinlock.h>
+#include<linux/log2.h>
+#include<linux/ktime.h>
+#include<linux/atomic.h>
+#include<linux/mm.h>
 #include "pcd_platform.h"
 
 
@@ -18,6 +23,16 @@
 #define MOD_LOGI(format,...) pr_info(TAG format __VA_OPT__(,) __VA_ARGS__)
 #define MOD_LOGE(format,...) pr_err(TAG format __VA_OPT__(,) __VA_ARGS__)
 
+/*
+	Device buffers are recycled through a pool of power of two size classes,
+	from 512 bytes to 64 KiB, so that bind/unbind cycles do not go through
+	the general purpose allocators. Larger buffers are not pooled.
+*/
+#define PCD_POOL_MIN_SHIFT	9
+#define PCD_POOL_MAX_SHIFT	16
+#define PCD_POOL_NR_CLASSES	(PCD_POOL_MAX_SHIFT - PCD_POOL_MIN_SHIFT + 1)
+#define PCD_POOL_DEPTH		8
+
 /* Device specific private data */
 struct pcdev_prv_data {
 
@@ -28,6 +43,15 @@ struct pcdev_prv_data {
 
 };
 
+/* Pre-zeroed buffers of one size class */
+struct pcd_buf_pool {
+
+	spinlock_t lock;
+	unsigned nr;
+	void* bufs[PCD_POOL_DEPTH];
+
+};
+
 /* Driver specific private data */
 struct pcdrv_prv_data {
 
@@ -36,6 +60,16 @@ struct pcdrv_prv_data {
 	struct class* class;
 	struct device* device;
 
+	/* allocation of per device data */
+	struct kmem_cache* dev_cache;
+	struct pcd_buf_pool pool[PCD_POOL_NR_CLASSES];
+
+	/* allocator statistics, exported under /sys/bus/platform/drivers/pseudo-char-device */
+	atomic64_t probes;
+	atomic64_t pool_hits;
+	atomic64_t pool_misses;
+	atomic64_t alloc_ns;
+
 };
 
 struct pcdrv_prv_data pcdrv_data;
@@ -58,6 +92,103 @@ struct file_operations pcd_fops = {
 	.llseek = pcd_llseek
 };
 
+/* Size class of a buffer, PCD_POOL_NR_CLASSES when it is not pooled */
+static unsigned pcd_buf_class(size_t size) {
+
+	if(size > (1U << PCD_POOL_MAX_SHIFT))
+		return PCD_POOL_NR_CLASSES;
+	return max_t(int, order_base_2(size), PCD_POOL_MIN_SHIFT) - PCD_POOL_MIN_SHIFT;
+}
+
+/* Get a zeroed buffer of size bytes on node, from the pool when possible */
+static void* pcd_buf_alloc(size_t size, int node) {
+
+	unsigned class = pcd_buf_class(size);
+	struct pcd_buf_pool* pool;
+	void* buf = NULL;
+	int i;
+
+	if(class == PCD_POOL_NR_CLASSES)
+		return kzalloc_node(size,GFP_KERNEL,node);
+
+	pool = &pcdrv_data.pool[class];
+	spin_lock(&pool->lock);
+	/* most recently freed first, and only buffers of the requested node */
+	for(i = pool->nr - 1; i >= 0; i--) {
+		if(node != NUMA_NO_NODE && page_to_nid(virt_to_page(pool->bufs[i])) != node)
+			continue;
+		buf = pool->bufs[i];
+		pool->bufs[i] = pool->bufs[--pool->nr];
+		break;
+	}
+	spin_unlock(&pool->lock);
+
+	if(buf) {
+		atomic64_inc(&pcdrv_data.pool_hits);
+		return buf;
+	}
+
+	atomic64_inc(&pcdrv_data.pool_misses);
+	return kzalloc_node(1U << (class + PCD_POOL_MIN_SHIFT),GFP_KERNEL,node);
+}
+
+/* Return a buffer to the pool, it is zeroed now so the next probe does not have to */
+static void pcd_buf_free(void* buf, size_t size) {
+
+	unsigned class = pcd_buf_class(size);
+	struct pcd_buf_pool* pool;
+
+	if(!buf)
+		return;
+	if(class == PCD_POOL_NR_CLASSES) {
+		kfree(buf);
+		return;
+	}
+
+	memset(buf,0,1U << (class + PCD_POOL_MIN_SHIFT));
+
+	pool = &pcdrv_data.pool[class];
+	spin_lock(&pool->lock);
+	if(pool->nr < PCD_POOL_DEPTH) {
+		pool->bufs[pool->nr++] = buf;
+		buf = NULL;
+	}
+	spin_unlock(&pool->lock);
+
+	kfree(buf);
+}
+
+static void pcd_buf_pool_drain(void) {
+
+	int i;
+
+	for(i = 0; i < PCD_POOL_NR_CLASSES; i++)
+		while(pcdrv_data.pool[i].nr)
+			kfree(pcdrv_data.pool[i].bufs[--pcdrv_data.pool[i].nr]);
+}
+
+/* Driver attributes reporting allocator statistics */
+#define PCD_STAT_ATTR(name)								\
+static ssize_t name##_show(struct device_driver* drv, char* buf) {			\
+											\
+	return sysfs_emit(buf, "%lld\n", atomic64_read(&pcdrv_data.name));		\
+}											\
+static DRIVER_ATTR_RO(name)
+
+PCD_STAT_ATTR(probes);
+PCD_STAT_ATTR(pool_hits);
+PCD_STAT_ATTR(pool_misses);
+PCD_STAT_ATTR(alloc_ns);
+
+static struct attribute* pcd_drv_attrs[] = {
+	&driver_attr_probes.attr,
+	&driver_attr_pool_hits.attr,
+	&driver_attr_pool_misses.attr,
+	&driver_attr_alloc_ns.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(pcd_drv);
+
 /* 
 	Support multiple versions of pcdev
 	TODO : Look at platform_match function in platform.c
@@ -79,7 +210,8 @@ struct platform_driver pcd_platform_drv = {
 	.remove = pcd_platform_drv_remove,
 	.id_table = pcdevs_id,
 	.driver = {
-			.name = "pseudo-char-device"
+			.name = "pseudo-char-device",
+			.groups = pcd_drv_groups
 	}
 
 };
@@ -88,6 +220,7 @@ struct platform_driver pcd_platform_drv = {
 static int pcd_platform_drv_probe(struct platform_device * pdev) {
 
 	int ret;
+	u64 alloc_start;
 	struct pcdev_prv_data* pcdev_data;
 
 	/* Get the platform data */
@@ -100,6 +233,8 @@ static int pcd_platform_drv_probe(struct platform_device * pdev) {
 		goto out;
 	}
 
+	alloc_start = ktime_get_ns();
+
 	/*
 		void* kzalloc(size_t size, gfp_t flags)
 		--> Allocate memory in kernel space initialized with zero 
@@ -112,7 +247,11 @@ static int pcd_platform_drv_probe(struct platform_device * pdev) {
 
 	*/
 
-	pcdev_data = kzalloc(sizeof(*pcdev_data),GFP_KERNEL);
+	/*
+		Keep the device data and buffer on the NUMA node of the device, so that
+		readers close to it do not pay for cross node accesses
+	*/
+	pcdev_data = kmem_cache_alloc_node(pcdrv_data.dev_cache,GFP_KERNEL | __GFP_ZERO,dev_to_node(&pdev->dev));
 	if(!pcdev_data) {
 		MOD_LOGE("memory allocation failed");
 		ret = -ENOMEM;
@@ -131,12 +270,13 @@ static int pcd_platform_drv_probe(struct platform_device * pdev) {
 		Dynamically allocate memory for device buffer using size data 
 		available in the platform data
 	*/
-		pcdev_data->buffer = kzalloc(pcdev_data->pdev.size,GFP_KERNEL);
+		pcdev_data->buffer = pcd_buf_alloc(pcdev_data->pdev.size,dev_to_node(&pdev->dev));
 		if(!pcdev_data->buffer){
 			MOD_LOGE("memory allocation failed");
 			ret = -ENOMEM;
 			goto dev_data_free;
 		}
+		atomic64_add(ktime_get_ns() - alloc_start,&pcdrv_data.alloc_ns);
 
 	/*
 		Get the device number
@@ -165,15 +305,16 @@ static int pcd_platform_drv_probe(struct platform_device * pdev) {
 		}
 
 	pcdrv_data.dev_count++;
+	atomic64_inc(&pcdrv_data.probes);
 	MOD_LOGI("probing successfull dev_count: %d",pcdrv_data.dev_count);
 	return 0;
 
 cdev_del :
 	cdev_del(&pcdev_data->cdev);
 buffer_free :
-	kfree(pcdev_data->buffer);
+	pcd_buf_free(pcdev_data->buffer,pcdev_data->pdev.size);
 dev_data_free :
-	kfree(pcdev_data);
+	kmem_cache_free(pcdrv_data.dev_cache,pcdev_data);
 out :
 	MOD_LOGI("Device probing failed");
 	return ret;
@@ -199,9 +340,9 @@ static int pcd_platform_drv_remove(struct platform_device * pdev) {
 		free the memory held by device
 	*/
 
-	kfree(pcdev_data->buffer);
-	kfree(pcdev_data);
-	pcdrv_data.dev_count++;
+	pcd_buf_free(pcdev_data->buffer,pcdev_data->pdev.size);
+	kmem_cache_free(pcdrv_data.dev_cache,pcdev_data);
+	pcdrv_data.dev_count--;
 
 	return 0;
 }
@@ -259,13 +400,34 @@ static int __init pcd_init(void) {
 	}
 
 
+	/* Dedicated cache for the per device data, bind/unbind churn reuses its objects */
+	pcdrv_data.dev_cache = kmem_cache_create("pcdev_prv_data",sizeof(struct pcdev_prv_data),0,SLAB_HWCACHE_ALIGN,NULL);
+	if(!pcdrv_data.dev_cache) {
+		MOD_LOGE("kmem_cache_create failed");
+		ret = -ENOMEM;
+		goto class_del;
+	}
+	for(int i = 0; i < PCD_POOL_NR_CLASSES; i++)
+		spin_lock_init(&pcdrv_data.pool[i].lock);
+
 	/* register the platform driver */
-	platform_driver_register(&pcd_platform_drv);
+	ret = platform_driver_register(&pcd_platform_drv);
+	if(ret < 0) {
+		MOD_LOGE("platform_driver_register failed");
+		goto cache_destroy;
+	}
 
 	MOD_LOGI("Module loaded");
 
 	return 0;
 
+cache_destroy :
+	kmem_cache_destroy(pcdrv_data.dev_cache);
+class_del :
+	class_destroy(pcdrv_data.class);
+	unregister_chrdev_region(pcdrv_data.dev_num_base,PCD_MAX_MINORS);
+	return ret;
+
 }
 
 static void __exit pcd_exit(void) {
@@ -273,6 +435,10 @@ static void __exit pcd_exit(void) {
 	/* unregister the platform driver */
 	platform_driver_unregister(&pcd_platform_drv);
 
+	/* all devices are gone, release the recycled memory */
+	pcd_buf_pool_drain();
+	kmem_cache_destroy(pcdrv_data.dev_cache);
+
 	/* remove the class */
 	class_destroy(pcdrv_data.class);
 